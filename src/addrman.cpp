@@ -85,22 +85,40 @@ CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int *pnId)
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
-    if (it2 != mapInfo.end())
-        return &(*it2).second;
-    return NULL;
+    return &vInfo[(*it).second];
 }
 
 CAddrInfo* CAddrMan::Create(const CAddress &addr, const CNetAddr &addrSource, int *pnId)
 {
-    int nId = nIdCount++;
-    mapInfo[nId] = CAddrInfo(addr, addrSource);
+    int nId;
+    if (vFreeIds.empty())
+    {
+        nId = vInfo.size();
+        vInfo.push_back(CAddrInfo(addr, addrSource));
+    } else {
+        nId = vFreeIds.back();
+        vFreeIds.pop_back();
+        vInfo[nId] = CAddrInfo(addr, addrSource);
+    }
     mapAddr[addr] = nId;
-    mapInfo[nId].nRandomPos = vRandom.size();
+    vInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
     if (pnId)
         *pnId = nId;
-    return &mapInfo[nId];
+    return &vInfo[nId];
+}
+
+void CAddrMan::Delete(int nId)
+{
+    CAddrInfo &info = vInfo[nId];
+    assert(info.nRandomPos >= 0 && !info.fInTried && info.nRefCount == 0);
+
+    SwapRandom(info.nRandomPos, vRandom.size()-1);
+    vRandom.pop_back();
+    mapAddr.erase(info);
+    info = CAddrInfo();
+    vFreeIds.push_back(nId);
+    nNew--;
 }
 
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
@@ -113,11 +131,8 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     int nId1 = vRandom[nRndPos1];
     int nId2 = vRandom[nRndPos2];
 
-    assert(mapInfo.count(nId1) == 1);
-    assert(mapInfo.count(nId2) == 1);
-
-    mapInfo[nId1].nRandomPos = nRndPos2;
-    mapInfo[nId2].nRandomPos = nRndPos1;
+    vInfo[nId1].nRandomPos = nRndPos2;
+    vInfo[nId2].nRandomPos = nRndPos1;
 
     vRandom[nRndPos1] = nId2;
     vRandom[nRndPos2] = nId1;
@@ -125,22 +140,21 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
 
 int CAddrMan::SelectTried(int nKBucket)
 {
-    std::vector<int> &vTried = vvTried[nKBucket];
+    int nSize = vvTried.GetSize(nKBucket);
 
     // random shuffle the first few elements (using the entire list)
     // find the least recently tried among them
     int64 nOldest = -1;
     int nOldestPos = -1;
-    for (unsigned int i = 0; i < ADDRMAN_TRIED_ENTRIES_INSPECT_ON_EVICT && i < vTried.size(); i++)
+    for (int i = 0; i < ADDRMAN_TRIED_ENTRIES_INSPECT_ON_EVICT && i < nSize; i++)
     {
-        int nPos = GetRandInt(vTried.size() - i) + i;
-        int nTemp = vTried[nPos];
-        vTried[nPos] = vTried[i];
-        vTried[i] = nTemp;
-        assert(nOldest == -1 || mapInfo.count(nTemp) == 1);
-        if (nOldest == -1 || mapInfo[nTemp].nLastSuccess < mapInfo[nOldest].nLastSuccess) {
+        int nPos = GetRandInt(nSize - i) + i;
+        int nTemp = vvTried.Get(nKBucket, nPos);
+        vvTried.Set(nKBucket, nPos, vvTried.Get(nKBucket, i));
+        vvTried.Set(nKBucket, i, nTemp);
+        if (nOldest == -1 || vInfo[nTemp].nLastSuccess < vInfo[nOldest].nLastSuccess) {
            nOldest = nTemp;
-           nOldestPos = nPos;
+           nOldestPos = i;
         }
     }
 
@@ -149,67 +163,55 @@ int CAddrMan::SelectTried(int nKBucket)
 
 int CAddrMan::ShrinkNew(int nUBucket)
 {
-    assert(nUBucket >= 0 && (unsigned int)nUBucket < vvNew.size());
-    std::set<int> &vNew = vvNew[nUBucket];
+    assert(nUBucket >= 0 && nUBucket < vvNew.GetCount());
+    int nSize = vvNew.GetSize(nUBucket);
 
     // first look for deletable items
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+    int64 nNow = GetAdjustedTime();
+    int nDelete = -1;
+    int nRet = 0;
+    for (int n = 0; n < nSize; n++)
     {
-        assert(mapInfo.count(*it));
-        CAddrInfo &info = mapInfo[*it];
-        if (info.IsTerrible())
+        if (vInfo[vvNew.Get(nUBucket, n)].IsTerrible(nNow))
         {
-            if (--info.nRefCount == 0)
-            {
-                SwapRandom(info.nRandomPos, vRandom.size()-1);
-                vRandom.pop_back();
-                mapAddr.erase(info);
-                mapInfo.erase(*it);
-                nNew--;
-            }
-            vNew.erase(it);
-            return 0;
+            nDelete = n;
+            break;
         }
     }
 
     // otherwise, select four randomly, and pick the oldest of those to replace
-    int n[4] = {GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size())};
-    int nI = 0;
-    int nOldest = -1;
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+    if (nDelete == -1)
     {
-        if (nI == n[0] || nI == n[1] || nI == n[2] || nI == n[3])
+        nRet = 1;
+        for (int i = 0; i < 4; i++)
         {
-            assert(nOldest == -1 || mapInfo.count(*it) == 1);
-            if (nOldest == -1 || mapInfo[*it].nTime < mapInfo[nOldest].nTime)
-                nOldest = *it;
+            int nPos = GetRandInt(nSize);
+            if (nDelete == -1 || vInfo[vvNew.Get(nUBucket, nPos)].nTime < vInfo[vvNew.Get(nUBucket, nDelete)].nTime)
+                nDelete = nPos;
         }
-        nI++;
     }
-    assert(mapInfo.count(nOldest) == 1);
-    CAddrInfo &info = mapInfo[nOldest];
-    if (--info.nRefCount == 0)
-    {
-        SwapRandom(info.nRandomPos, vRandom.size()-1);
-        vRandom.pop_back();
-        mapAddr.erase(info);
-        mapInfo.erase(nOldest);
-        nNew--;
-    }
-    vNew.erase(nOldest);
 
-    return 1;
+    int nId = vvNew.Get(nUBucket, nDelete);
+    vvNew.Erase(nUBucket, nDelete);
+    if (--vInfo[nId].nRefCount == 0)
+        Delete(nId);
+
+    return nRet;
 }
 
 void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 {
-    assert(vvNew[nOrigin].count(nId) == 1);
+    assert(vvNew.Find(nOrigin, nId) != -1);
 
     // remove the entry from all new buckets
-    for (std::vector<std::set<int> >::iterator it = vvNew.begin(); it != vvNew.end(); it++)
+    for (int b = 0; b < vvNew.GetCount() && info.nRefCount > 0; b++)
     {
-        if ((*it).erase(nId))
+        int nPos = vvNew.Find(b, nId);
+        if (nPos != -1)
+        {
+            vvNew.Erase(b, nPos);
             info.nRefCount--;
+        }
     }
     nNew--;
 
@@ -217,12 +219,11 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 
     // what tried bucket to move the entry to
     int nKBucket = info.GetTriedBucket(nKey);
-    std::vector<int> &vTried = vvTried[nKBucket];
 
     // first check whether there is place to just add it
-    if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
+    if (!vvTried.IsFull(nKBucket))
     {
-        vTried.push_back(nId);
+        vvTried.Insert(nKBucket, nId);
         nTried++;
         info.fInTried = true;
         return;
@@ -230,31 +231,30 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 
     // otherwise, find an item to evict
     int nPos = SelectTried(nKBucket);
+    int nIdOld = vvTried.Get(nKBucket, nPos);
 
     // find which new bucket it belongs to
-    assert(mapInfo.count(vTried[nPos]) == 1);
-    int nUBucket = mapInfo[vTried[nPos]].GetNewBucket(nKey);
-    std::set<int> &vNew = vvNew[nUBucket];
+    CAddrInfo& infoOld = vInfo[nIdOld];
+    int nUBucket = infoOld.GetNewBucket(nKey);
 
     // remove the to-be-replaced tried entry from the tried set
-    CAddrInfo& infoOld = mapInfo[vTried[nPos]];
     infoOld.fInTried = false;
     infoOld.nRefCount = 1;
     // do not update nTried, as we are going to move something else there immediately
 
     // check whether there is place in that one,
-    if (vNew.size() < ADDRMAN_NEW_BUCKET_SIZE)
+    if (!vvNew.IsFull(nUBucket))
     {
         // if so, move it back there
-        vNew.insert(vTried[nPos]);
+        vvNew.Insert(nUBucket, nIdOld);
     } else {
         // otherwise, move it to the new bucket nId came from (there is certainly place there)
-        vvNew[nOrigin].insert(vTried[nPos]);
+        vvNew.Insert(nOrigin, nIdOld);
     }
     nNew++;
 
-    vTried[nPos] = nId;
-    // we just overwrote an entry in vTried; no need to update nTried
+    vvTried.Set(nKBucket, nPos, nId);
+    // we just overwrote an entry in vvTried; no need to update nTried
     info.fInTried = true;
     return;
 }
@@ -287,13 +287,12 @@ void CAddrMan::Good_(const CService &addr, int64 nTime)
         return;
 
     // find a bucket it is in now
-    int nRnd = GetRandInt(vvNew.size());
+    int nRnd = GetRandInt(vvNew.GetCount());
     int nUBucket = -1;
-    for (unsigned int n = 0; n < vvNew.size(); n++)
+    for (int n = 0; n < vvNew.GetCount(); n++)
     {
-        int nB = (n+nRnd) % vvNew.size();
-        std::set<int> &vNew = vvNew[nB];
-        if (vNew.count(nId))
+        int nB = (n+nRnd) % vvNew.GetCount();
+        if (vvNew.Find(nB, nId) != -1)
         {
             nUBucket = nB;
             break;
@@ -357,13 +356,12 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64 nTimePen
     }
 
     int nUBucket = pinfo->GetNewBucket(nKey, source);
-    std::set<int> &vNew = vvNew[nUBucket];
-    if (!vNew.count(nId))
+    if (vvNew.Find(nUBucket, nId) == -1)
     {
         pinfo->nRefCount++;
-        if (vNew.size() == ADDRMAN_NEW_BUCKET_SIZE)
+        if (vvNew.IsFull(nUBucket))
             ShrinkNew(nUBucket);
-        vvNew[nUBucket].insert(nId);
+        vvNew.Insert(nUBucket, nId);
     }
     return fNew;
 }
@@ -394,40 +392,31 @@ CAddress CAddrMan::Select_(int nUnkBias)
 
     double nCorTried = sqrt(nTried) * (100.0 - nUnkBias);
     double nCorNew = sqrt(nNew) * nUnkBias;
-    if ((nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried)
+    bool fTried = (nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried;
+    if (vvNew.IsEmpty())
+        fTried = true;
+    else if (vvTried.IsEmpty())
+        fTried = false;
+
+    // pick a random non-empty bucket, then a random entry in it; the chance
+    // factor grows so that this ends after a few rounds
+    int64 nNow = GetAdjustedTime();
+    double fChanceFactor = 1.0;
+    while(1)
     {
-        // use a tried node
-        double fChanceFactor = 1.0;
-        while(1)
+        int nId;
+        if (fTried)
         {
-            int nKBucket = GetRandInt(vvTried.size());
-            std::vector<int> &vTried = vvTried[nKBucket];
-            if (vTried.size() == 0) continue;
-            int nPos = GetRandInt(vTried.size());
-            assert(mapInfo.count(vTried[nPos]) == 1);
-            CAddrInfo &info = mapInfo[vTried[nPos]];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
-    } else {
-        // use a new node
-        double fChanceFactor = 1.0;
-        while(1)
-        {
-            int nUBucket = GetRandInt(vvNew.size());
-            std::set<int> &vNew = vvNew[nUBucket];
-            if (vNew.size() == 0) continue;
-            int nPos = GetRandInt(vNew.size());
-            std::set<int>::iterator it = vNew.begin();
-            while (nPos--)
-                it++;
-            assert(mapInfo.count(*it) == 1);
-            CAddrInfo &info = mapInfo[*it];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
-                return info;
-            fChanceFactor *= 1.2;
+            int nKBucket = vvTried.GetRandomBucket();
+            nId = vvTried.Get(nKBucket, GetRandInt(vvTried.GetSize(nKBucket)));
+        } else {
+            int nUBucket = vvNew.GetRandomBucket();
+            nId = vvNew.Get(nUBucket, GetRandInt(vvNew.GetSize(nUBucket)));
         }
+        CAddrInfo &info = vInfo[nId];
+        if (GetRandInt(1<<30) < fChanceFactor*info.GetChance(nNow)*(1<<30))
+            return info;
+        fChanceFactor *= 1.2;
     }
 }
 
@@ -439,10 +428,11 @@ int CAddrMan::Check_()
 
     if (vRandom.size() != nTried + nNew) return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    for (unsigned int n = 0; n < vInfo.size(); n++)
     {
-        int n = (*it).first;
-        CAddrInfo &info = (*it).second;
+        CAddrInfo &info = vInfo[n];
+        if (info.nRandomPos < 0)
+            continue;
         if (info.fInTried)
         {
 
@@ -463,24 +453,25 @@ int CAddrMan::Check_()
     if (setTried.size() != nTried) return -9;
     if (mapNew.size() != nNew) return -10;
 
-    for (int n=0; n<vvTried.size(); n++)
+    for (int n=0; n<vvTried.GetCount(); n++)
     {
-        std::vector<int> &vTried = vvTried[n];
-        for (std::vector<int>::iterator it = vTried.begin(); it != vTried.end(); it++)
+        for (int i=0; i<vvTried.GetSize(n); i++)
         {
-            if (!setTried.count(*it)) return -11;
-            setTried.erase(*it);
+            int nId = vvTried.Get(n, i);
+            if (!setTried.count(nId)) return -11;
+            setTried.erase(nId);
         }
     }
 
-    for (int n=0; n<vvNew.size(); n++)
+    for (int n=0; n<vvNew.GetCount(); n++)
     {
-        std::set<int> &vNew = vvNew[n];
-        for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+        for (int i=0; i<vvNew.GetSize(n); i++)
         {
-            if (!mapNew.count(*it)) return -12;
-            if (--mapNew[*it] == 0)
-                mapNew.erase(*it);
+            int nId = vvNew.Get(n, i);
+            if (!mapNew.count(nId)) return -12;
+            if (vvNew.Find(n, nId) != i) return -16;
+            if (--mapNew[nId] == 0)
+                mapNew.erase(nId);
         }
     }
 
@@ -502,8 +493,7 @@ void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
     {
         int nRndPos = GetRandInt(vRandom.size() - n) + n;
         SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-        vAddr.push_back(mapInfo[vRandom[n]]);
+        vAddr.push_back(vInfo[vRandom[n]]);
     }
 }
 
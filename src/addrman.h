@@ -38,7 +38,7 @@ private:
     // in tried set? (memory only)
     bool fInTried;
 
-    // position in vRandom
+    // position in vRandom, or -1 if this slot in vInfo is unused
     int nRandomPos;
 
     friend class CAddrMan;
@@ -161,6 +161,99 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+/** A table of nCount buckets holding up to nSize nIds each, in one flat array.
+ *  The entries of a bucket are packed at its start, and the non-empty buckets
+ *  are indexed, so that a random bucket and a random entry in it are found in
+ *  constant time. */
+template<int nCount, int nSize>
+class CAddrTable
+{
+private:
+    int vnId[nCount * nSize];
+    int vnSize[nCount];
+
+    // the non-empty buckets, in no particular order
+    std::vector<int> vUsed;
+
+    // position of each bucket in vUsed, or -1
+    int vnUsedPos[nCount];
+
+public:
+    CAddrTable()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        for (int n = 0; n < nCount; n++)
+        {
+            vnSize[n] = 0;
+            vnUsedPos[n] = -1;
+        }
+        vUsed.clear();
+    }
+
+    // number of buckets
+    int GetCount() const { return nCount; }
+
+    // number of entries in a bucket
+    int GetSize(int nBucket) const { return vnSize[nBucket]; }
+
+    bool IsFull(int nBucket) const { return vnSize[nBucket] == nSize; }
+
+    // whether all buckets are empty
+    bool IsEmpty() const { return vUsed.empty(); }
+
+    int Get(int nBucket, int nPos) const { return vnId[nBucket * nSize + nPos]; }
+
+    void Set(int nBucket, int nPos, int nId) { vnId[nBucket * nSize + nPos] = nId; }
+
+    // Return the position of nId in a bucket, or -1.
+    int Find(int nBucket, int nId) const
+    {
+        const int *pnId = &vnId[nBucket * nSize];
+        for (int n = 0; n < vnSize[nBucket]; n++)
+            if (pnId[n] == nId)
+                return n;
+        return -1;
+    }
+
+    // Append nId to a bucket that isn't full.
+    void Insert(int nBucket, int nId)
+    {
+        assert(vnSize[nBucket] < nSize);
+        if (vnSize[nBucket] == 0)
+        {
+            vnUsedPos[nBucket] = vUsed.size();
+            vUsed.push_back(nBucket);
+        }
+        vnId[nBucket * nSize + vnSize[nBucket]++] = nId;
+    }
+
+    // Remove the entry at nPos from a bucket; the last entry takes its place.
+    void Erase(int nBucket, int nPos)
+    {
+        assert(nPos >= 0 && nPos < vnSize[nBucket]);
+        int nLast = --vnSize[nBucket];
+        vnId[nBucket * nSize + nPos] = vnId[nBucket * nSize + nLast];
+        if (nLast == 0)
+        {
+            int nUsedPos = vnUsedPos[nBucket];
+            vUsed[nUsedPos] = vUsed.back();
+            vnUsedPos[vUsed[nUsedPos]] = nUsedPos;
+            vUsed.pop_back();
+            vnUsedPos[nBucket] = -1;
+        }
+    }
+
+    // Return a random non-empty bucket; the table must not be empty.
+    int GetRandomBucket() const
+    {
+        return vUsed[GetRandInt(vUsed.size())];
+    }
+};
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
@@ -171,11 +264,11 @@ private:
     // secret key to randomize bucket select with
     std::vector<unsigned char> nKey;
 
-    // last used nId
-    int nIdCount;
+    // table with information about all nIds, indexed by nId
+    std::vector<CAddrInfo> vInfo;
 
-    // table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    // unused nIds in vInfo, to be handed out again
+    std::vector<int> vFreeIds;
 
     // find an nId based on its network address
     std::map<CNetAddr, int> mapAddr;
@@ -186,14 +279,14 @@ private:
     // number of "tried" entries
     int nTried;
 
-    // list of "tried" buckets
-    std::vector<std::vector<int> > vvTried;
+    // "tried" buckets
+    CAddrTable<ADDRMAN_TRIED_BUCKET_COUNT, ADDRMAN_TRIED_BUCKET_SIZE> vvTried;
 
     // number of (unique) "new" entries
     int nNew;
 
-    // list of "new" buckets
-    std::vector<std::set<int> > vvNew;
+    // "new" buckets
+    CAddrTable<ADDRMAN_NEW_BUCKET_COUNT, ADDRMAN_NEW_BUCKET_SIZE> vvNew;
 
 protected:
 
@@ -204,6 +297,9 @@ protected:
     // nTime and nServices of found node is updated, if necessary.
     CAddrInfo* Create(const CAddress &addr, const CNetAddr &addrSource, int *pnId = NULL);
 
+    // Delete an entry that is in no bucket anymore.
+    void Delete(int nId);
+
     // Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
@@ -216,7 +312,7 @@ protected:
     int ShrinkNew(int nUBucket);
 
     // Move an entry from the "new" table(s) to the "tried" table
-    // @pre vvUnkown[nOrigin].count(nId) != 0
+    // @pre vvNew.Find(nOrigin, nId) != -1
     void MakeTried(CAddrInfo& info, int nId, int nOrigin);
 
     // Mark an entry "good", possibly moving it from "new" to "tried".
@@ -280,79 +376,86 @@ public:
             {
                 int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT;
                 READWRITE(nUBuckets);
-                std::map<int, int> mapUnkIds;
+                // nIds are written as their index among the "new" entries, which
+                // are numbered in nRandomPos order
+                std::vector<int> vUnkIds(am->vRandom.size(), -1);
                 int nIds = 0;
-                for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
+                for (std::vector<CAddrInfo>::iterator it = am->vInfo.begin(); it != am->vInfo.end(); it++)
                 {
                     if (nIds == nNew) break; // this means nNew was wrong, oh ow
-                    mapUnkIds[(*it).first] = nIds;
-                    CAddrInfo &info = (*it).second;
-                    if (info.nRefCount)
+                    CAddrInfo &info = (*it);
+                    if (info.nRandomPos >= 0 && info.nRefCount)
                     {
+                        vUnkIds[info.nRandomPos] = nIds;
                         READWRITE(info);
                         nIds++;
                     }
                 }
                 nIds = 0;
-                for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
+                for (std::vector<CAddrInfo>::iterator it = am->vInfo.begin(); it != am->vInfo.end(); it++)
                 {
                     if (nIds == nTried) break; // this means nTried was wrong, oh ow
-                    CAddrInfo &info = (*it).second;
-                    if (info.fInTried)
+                    CAddrInfo &info = (*it);
+                    if (info.nRandomPos >= 0 && info.fInTried)
                     {
                         READWRITE(info);
                         nIds++;
                     }
                 }
-                for (std::vector<std::set<int> >::iterator it = am->vvNew.begin(); it != am->vvNew.end(); it++)
+                for (int b = 0; b < nUBuckets; b++)
                 {
-                    const std::set<int> &vNew = (*it);
-                    int nSize = vNew.size();
+                    int nSize = am->vvNew.GetSize(b);
                     READWRITE(nSize);
-                    for (std::set<int>::iterator it2 = vNew.begin(); it2 != vNew.end(); it2++)
+                    for (int n = 0; n < nSize; n++)
                     {
-                        int nIndex = mapUnkIds[*it2];
+                        int nIndex = vUnkIds[am->vInfo[am->vvNew.Get(b, n)].nRandomPos];
                         READWRITE(nIndex);
                     }
                 }
             } else {
                 int nUBuckets = 0;
                 READWRITE(nUBuckets);
-                am->nIdCount = 0;
-                am->mapInfo.clear();
+                am->vInfo.clear();
+                am->vFreeIds.clear();
                 am->mapAddr.clear();
                 am->vRandom.clear();
-                am->vvTried = std::vector<std::vector<int> >(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0));
-                am->vvNew = std::vector<std::set<int> >(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>());
+                am->vvTried.Clear();
+                am->vvNew.Clear();
+                am->vRandom.reserve(am->nNew + am->nTried);
+                am->vInfo.reserve(am->nNew + am->nTried);
+                am->vInfo.resize(am->nNew);
                 for (int n = 0; n < am->nNew; n++)
                 {
-                    CAddrInfo &info = am->mapInfo[n];
+                    CAddrInfo &info = am->vInfo[n];
                     READWRITE(info);
                     am->mapAddr[info] = n;
                     info.nRandomPos = vRandom.size();
                     am->vRandom.push_back(n);
                     if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT)
                     {
-                        am->vvNew[info.GetNewBucket(am->nKey)].insert(n);
-                        info.nRefCount++;
+                        int nUBucket = info.GetNewBucket(am->nKey);
+                        if (!am->vvNew.IsFull(nUBucket) && am->vvNew.Find(nUBucket, n) == -1)
+                        {
+                            am->vvNew.Insert(nUBucket, n);
+                            info.nRefCount++;
+                        }
                     }
                 }
-                am->nIdCount = am->nNew;
                 int nLost = 0;
                 for (int n = 0; n < am->nTried; n++)
                 {
                     CAddrInfo info;
                     READWRITE(info);
-                    std::vector<int> &vTried = am->vvTried[info.GetTriedBucket(am->nKey)];
-                    if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
+                    int nKBucket = info.GetTriedBucket(am->nKey);
+                    if (!am->vvTried.IsFull(nKBucket))
                     {
                         info.nRandomPos = vRandom.size();
                         info.fInTried = true;
-                        am->vRandom.push_back(am->nIdCount);
-                        am->mapInfo[am->nIdCount] = info;
-                        am->mapAddr[info] = am->nIdCount;
-                        vTried.push_back(am->nIdCount);
-                        am->nIdCount++;
+                        int nId = am->vInfo.size();
+                        am->vRandom.push_back(nId);
+                        am->vInfo.push_back(info);
+                        am->mapAddr[info] = nId;
+                        am->vvTried.Insert(nKBucket, nId);
                     } else {
                         nLost++;
                     }
@@ -360,37 +463,43 @@ public:
                 am->nTried -= nLost;
                 for (int b = 0; b < nUBuckets; b++)
                 {
-                    std::set<int> &vNew = am->vvNew[b];
                     int nSize = 0;
                     READWRITE(nSize);
                     for (int n = 0; n < nSize; n++)
                     {
                         int nIndex = 0;
                         READWRITE(nIndex);
-                        CAddrInfo &info = am->mapInfo[nIndex];
-                        if (nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
+                        if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT || nIndex < 0 || nIndex >= am->nNew)
+                            continue;
+                        CAddrInfo &info = am->vInfo[nIndex];
+                        if (info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS && !am->vvNew.IsFull(b) && am->vvNew.Find(b, nIndex) == -1)
                         {
                             info.nRefCount++;
-                            vNew.insert(nIndex);
+                            am->vvNew.Insert(b, nIndex);
                         }
                     }
                 }
+                // "new" entries that found no room in any bucket are dropped, so
+                // that nNew matches what is in the buckets
+                int nNewRead = am->nNew;
+                for (int n = 0; n < nNewRead; n++)
+                    if (am->vInfo[n].nRefCount == 0)
+                        am->Delete(n);
             }
         }
     });)
 
-    CAddrMan() : vRandom(0), vvTried(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0)), vvNew(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>())
+    CAddrMan() : vRandom(0)
     {
          nKey.resize(32);
          RAND_bytes(&nKey[0], 32);
 
-         nIdCount = 0;
          nTried = 0;
          nNew = 0;
     }
 
     // Return the number of (unique) addresses in all tables.
-    int size()
+    int size() const
     {
         return vRandom.size();
     }
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "bloom.h"
 #include "main.h"
@@ -29,45 +30,71 @@ nFlags(nFlagsIn)
 {
 }
 
-inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
+// Bit positions of the key for each hash function, all computed in one pass.
+// Returns the number of positions, which never exceeds MAX_HASH_FUNCS (filters
+// over the limit are rejected on receipt, see IsWithinSizeConstraints).
+inline unsigned int CBloomFilter::Hash(const unsigned char* pbegin, const unsigned char* pend, unsigned int* pnIndex) const
 {
+    unsigned int nHashes = min(nHashFuncs, MAX_HASH_FUNCS);
     // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash) % (vData.size() * 8);
+    MurmurHash3Multi(nTweak, 0xFBA4C795, pbegin, pend, pnIndex, nHashes);
+    for (unsigned int i = 0; i < nHashes; i++)
+        pnIndex[i] %= vData.size() * 8;
+    return nHashes;
 }
 
-void CBloomFilter::insert(const vector<unsigned char>& vKey)
+// The network serialization of an outpoint: its hash, then its index as 4 little-endian bytes
+static const unsigned int OUTPOINT_SIZE = 36;
+static void SerializeOutPoint(const COutPoint& outpoint, unsigned char* pch)
+{
+    memcpy(pch, outpoint.hash.begin(), 32);
+    pch[32] = outpoint.n;
+    pch[33] = outpoint.n >> 8;
+    pch[34] = outpoint.n >> 16;
+    pch[35] = outpoint.n >> 24;
+}
+
+void CBloomFilter::insert(const unsigned char* pbegin, const unsigned char* pend)
 {
     if (vData.size() == 1 && vData[0] == 0xff)
         return;
-    for (unsigned int i = 0; i < nHashFuncs; i++)
+    unsigned int vnIndex[MAX_HASH_FUNCS];
+    unsigned int nHashes = Hash(pbegin, pend, vnIndex);
+    for (unsigned int i = 0; i < nHashes; i++)
     {
-        unsigned int nIndex = Hash(i, vKey);
+        unsigned int nIndex = vnIndex[i];
         // Sets bit nIndex of vData
         vData[nIndex >> 3] |= bit_mask[7 & nIndex];
     }
 }
 
+void CBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    const unsigned char* pbegin = vKey.empty() ? NULL : &vKey[0];
+    insert(pbegin, pbegin + vKey.size());
+}
+
 void CBloomFilter::insert(const COutPoint& outpoint)
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    insert(data);
+    unsigned char data[OUTPOINT_SIZE];
+    SerializeOutPoint(outpoint, data);
+    insert(data, data + OUTPOINT_SIZE);
 }
 
 void CBloomFilter::insert(const uint256& hash)
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    insert(data);
+    insert(hash.begin(), hash.end());
 }
 
-bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+bool CBloomFilter::contains(const unsigned char* pbegin, const unsigned char* pend) const
 {
     if (vData.size() == 1 && vData[0] == 0xff)
         return true;
-    for (unsigned int i = 0; i < nHashFuncs; i++)
+    unsigned int vnIndex[MAX_HASH_FUNCS];
+    unsigned int nHashes = Hash(pbegin, pend, vnIndex);
+    for (unsigned int i = 0; i < nHashes; i++)
     {
-        unsigned int nIndex = Hash(i, vKey);
+        unsigned int nIndex = vnIndex[i];
         // Checks bit nIndex of vData
         if (!(vData[nIndex >> 3] & bit_mask[7 & nIndex]))
             return false;
@@ -75,18 +102,27 @@ bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
     return true;
 }
 
+bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    const unsigned char* pbegin = vKey.empty() ? NULL : &vKey[0];
+    return contains(pbegin, pbegin + vKey.size());
+}
+
 bool CBloomFilter::contains(const COutPoint& outpoint) const
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    return contains(data);
+    unsigned char data[OUTPOINT_SIZE];
+    SerializeOutPoint(outpoint, data);
+    return contains(data, data + OUTPOINT_SIZE);
 }
 
 bool CBloomFilter::contains(const uint256& hash) const
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    return contains(data);
+    return contains(hash.begin(), hash.end());
+}
+
+void CBloomFilter::clear()
+{
+    vData.assign(vData.size(), 0);
 }
 
 bool CBloomFilter::IsWithinSizeConstraints() const
@@ -95,66 +131,184 @@ bool CBloomFilter::IsWithinSizeConstraints() const
 }
 
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash)
+{
+    return IsRelevantAndUpdate(CBloomFilterElements(tx, hash));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomFilterElements& elements)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
     //  for finding tx when they appear in a block
-    if (contains(hash))
+    if (contains(elements.hash))
         fFound = true;
 
-    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    unsigned int nData = 0;
+    for (unsigned int i = 0; i < elements.vOutputEnd.size(); i++)
     {
-        const CTxOut& txout = tx.vout[i];
         // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx 
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        for (; nData < elements.vOutputEnd[i]; nData++)
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(elements.vOutputData[nData]))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
-                    insert(COutPoint(hash, i));
-                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
-                {
-                    txnouttype type;
-                    vector<vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
-                            (type == TX_PUBKEY || type == TX_MULTISIG))
-                        insert(COutPoint(hash, i));
-                }
+                    insert(COutPoint(elements.hash, i));
+                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY && elements.vOutputP2PubKey[i])
+                    insert(COutPoint(elements.hash, i));
                 break;
             }
         }
+        nData = elements.vOutputEnd[i];
     }
 
     if (fFound)
         return true;
 
+    // Match if the filter contains an outpoint tx spends,
+    // or any arbitrary script data element in any scriptSig in tx
+    BOOST_FOREACH(const vector<unsigned char>& data, elements.vInputData)
+        if (contains(data))
+            return true;
+
+    return false;
+}
+
+// Appends the non-empty data elements pushed by script, up to the first unparseable opcode
+static void ExtractScriptData(const CScript& script, vector<vector<unsigned char> >& vData)
+{
+    CScript::const_iterator pc = script.begin();
+    vector<unsigned char> data;
+    while (pc < script.end())
+    {
+        opcodetype opcode;
+        if (!script.GetOp(pc, opcode, data))
+            break;
+        if (data.size() != 0)
+            vData.push_back(data);
+    }
+}
+
+CBloomFilterElements::CBloomFilterElements(const CTransaction& tx, const uint256& hashIn) : hash(hashIn)
+{
+    vOutputEnd.reserve(tx.vout.size());
+    vOutputP2PubKey.reserve(tx.vout.size());
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        ExtractScriptData(txout.scriptPubKey, vOutputData);
+        vOutputEnd.push_back(vOutputData.size());
+
+        txnouttype type;
+        vector<vector<unsigned char> > vSolutions;
+        vOutputP2PubKey.push_back(Solver(txout.scriptPubKey, type, vSolutions) &&
+                                  (type == TX_PUBKEY || type == TX_MULTISIG));
+    }
+
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
-            return true;
+        unsigned char data[OUTPOINT_SIZE];
+        SerializeOutPoint(txin.prevout, data);
+        vInputData.push_back(vector<unsigned char>(data, data + OUTPOINT_SIZE));
+        ExtractScriptData(txin.scriptSig, vInputData);
+    }
+}
 
-        // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
-        {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
-                return true;
-        }
+// Two filters sized for 2 * nElements each, cleared in turn every nElements
+// insertions, so that one of them always holds at least the last nElements.
+// Unlike CBloomFilter, which has to match the protocol, this is only used
+// locally, so the bit positions are derived from two hashes of the key
+// (h1 + i * h2, see Kirsch and Mitzenmacher, "Less Hashing, Same Performance")
+// instead of computing one hash per hash function.
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweakIn) :
+nBloomSize(nElements * 2),
+nInsertions(0),
+nTweak(nTweakIn)
+{
+    nBits = max((unsigned int)(-1 / LN2SQUARED * nBloomSize * log(nFPRate)), 64u);
+    nHashFuncs = max(min((unsigned int)(nBits / nBloomSize * LN2), MAX_HASH_FUNCS), 1u);
+    vData.assign((nBits + 63) / 64 * 2, 0);
+}
+
+inline void CRollingBloomFilter::Hash(const unsigned char* pbegin, const unsigned char* pend, unsigned int& nHash1, unsigned int& nHash2) const
+{
+    unsigned int vnHash[2];
+    MurmurHash3Multi(nTweak, 0xFBA4C795, pbegin, pend, vnHash, 2);
+    nHash1 = vnHash[0];
+    nHash2 = vnHash[1] | 1;
+}
+
+// Maps a 32 bit hash onto [0, nBits) without a division
+static inline unsigned int FastRange(unsigned int nHash, unsigned int nBits)
+{
+    return ((uint64)nHash * nBits) >> 32;
+}
+
+void CRollingBloomFilter::insert(const unsigned char* pbegin, const unsigned char* pend)
+{
+    if (nInsertions == 0 || nInsertions == nBloomSize / 2)
+    {
+        int nFilter = nInsertions == 0 ? 0 : 1;
+        for (unsigned int i = nFilter; i < vData.size(); i += 2)
+            vData[i] = 0;
+    }
+    unsigned int nHash1, nHash2;
+    Hash(pbegin, pend, nHash1, nHash2);
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nIndex = FastRange(nHash1 + i * nHash2, nBits);
+        uint64 nBit = (uint64)1 << (nIndex & 63);
+        unsigned int nWord = (nIndex >> 6) << 1;
+        vData[nWord] |= nBit;
+        vData[nWord + 1] |= nBit;
     }
+    if (++nInsertions == nBloomSize)
+        nInsertions = 0;
+}
 
-    return false;
+void CRollingBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    const unsigned char* pbegin = vKey.empty() ? NULL : &vKey[0];
+    insert(pbegin, pbegin + vKey.size());
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    insert(hash.begin(), hash.end());
+}
+
+bool CRollingBloomFilter::contains(const unsigned char* pbegin, const unsigned char* pend) const
+{
+    // The second filter was last cleared nBloomSize / 2 insertions into the
+    // previous round, the first at the start of this one; ask whichever has
+    // seen more
+    unsigned int nFilter = nInsertions < nBloomSize / 2 ? 1 : 0;
+    unsigned int nHash1, nHash2;
+    Hash(pbegin, pend, nHash1, nHash2);
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nIndex = FastRange(nHash1 + i * nHash2, nBits);
+        if (!(vData[((nIndex >> 6) << 1) + nFilter] & ((uint64)1 << (nIndex & 63))))
+            return false;
+    }
+    return true;
+}
+
+bool CRollingBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    const unsigned char* pbegin = vKey.empty() ? NULL : &vKey[0];
+    return contains(pbegin, pbegin + vKey.size());
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    return contains(hash.begin(), hash.end());
+}
+
+void CRollingBloomFilter::clear()
+{
+    vData.assign(vData.size(), 0);
+    nInsertions = 0;
 }
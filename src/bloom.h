@@ -27,6 +27,27 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The parts of a transaction that a bloom filter is matched against: its hash,
+ * the data elements pushed by its scripts and the outpoints it spends.
+ * Extracting them once lets any number of filters be tested against the same
+ * transaction without parsing its scripts again.
+ */
+class CBloomFilterElements
+{
+public:
+    uint256 hash;
+    // Data elements of all scriptPubKeys; those of output i end at vOutputEnd[i]
+    std::vector<std::vector<unsigned char> > vOutputData;
+    std::vector<unsigned int> vOutputEnd;
+    // Outputs which BLOOM_UPDATE_P2PUBKEY_ONLY adds to the filter when matched
+    std::vector<bool> vOutputP2PubKey;
+    // Serialized prevouts and the data elements of all scriptSigs
+    std::vector<std::vector<unsigned char> > vInputData;
+
+    CBloomFilterElements(const CTransaction& tx, const uint256& hashIn);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we sends them.
@@ -46,7 +67,7 @@ private:
     unsigned int nTweak;
     unsigned char nFlags;
 
-    unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    unsigned int Hash(const unsigned char* pbegin, const unsigned char* pend, unsigned int* pnIndex) const;
 
 public:
     // Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
@@ -69,20 +90,61 @@ public:
         READWRITE(nFlags);
     )
 
+    void insert(const unsigned char* pbegin, const unsigned char* pend);
     void insert(const std::vector<unsigned char>& vKey);
     void insert(const COutPoint& outpoint);
     void insert(const uint256& hash);
 
+    bool contains(const unsigned char* pbegin, const unsigned char* pend) const;
     bool contains(const std::vector<unsigned char>& vKey) const;
     bool contains(const COutPoint& outpoint) const;
     bool contains(const uint256& hash) const;
 
+    void clear();
+
     // True if the size is <= MAX_BLOOM_FILTER_SIZE and the number of hash functions is <= MAX_HASH_FUNCS
     // (catch a filter which was just deserialized which was too big)
     bool IsWithinSizeConstraints() const;
 
     // Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash);
+    bool IsRelevantAndUpdate(const CBloomFilterElements& elements);
+};
+
+/**
+ * RollingBloomFilter keeps track of the most recently inserted items in a
+ * fixed amount of memory.
+ *
+ * contains(item) always returns true if item was one of the last nElements
+ * items inserted, and returns true with probability of roughly nFPRate for
+ * items which were never inserted. Older items are forgotten in batches.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
+
+    void insert(const unsigned char* pbegin, const unsigned char* pend);
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const unsigned char* pbegin, const unsigned char* pend) const;
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    void clear();
+
+private:
+    unsigned int nBloomSize;
+    unsigned int nInsertions;
+    unsigned int nBits; // positions in each of the two filters
+    unsigned int nHashFuncs;
+    unsigned int nTweak;
+    // The two filters interleaved in 64 bit words: the first filter's bits for
+    // positions 64 * i ... 64 * i + 63 are in word 2 * i, the second's in word
+    // 2 * i + 1, so that an insertion into both touches one cache line per probe
+    std::vector<uint64> vData;
+
+    void Hash(const unsigned char* pbegin, const unsigned char* pend, unsigned int& nHash1, unsigned int& nHash2) const;
 };
 
 #endif /* BITCOIN_BLOOM_H */
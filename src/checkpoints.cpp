@@ -127,7 +127,7 @@ namespace Checkpoints
         return checkpoints.rbegin()->first;
     }
 
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex)
+    CBlockIndex* GetLastCheckpoint()
     {
         if (!fEnabled)
             return NULL;
@@ -137,8 +137,10 @@ namespace Checkpoints
         BOOST_REVERSE_FOREACH(const MapCheckpoints::value_type& i, checkpoints)
         {
             const uint256& hash = i.second;
-            std::map<uint256, CBlockIndex*>::const_iterator t = mapBlockIndex.find(hash);
-            if (t != mapBlockIndex.end())
+            BlockMap::const_iterator t = mapBlockIndex.find(hash);
+            // With headers-first sync the index also holds checkpoints whose
+            // blocks aren't connected yet, while blocks below them still arrive
+            if (t != mapBlockIndex.end() && pindexBest && pindexBest->GetAncestor(t->second->nHeight) == t->second)
                 return t->second;
         }
         return NULL;
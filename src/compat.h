@@ -24,6 +24,12 @@
 #include <net/if.h>
 #include <netinet/in.h>
 #include <ifaddrs.h>
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+// Wait for socket readiness with epoll instead of select() (see ThreadSocketHandler)
+#define USE_EPOLL 1
 #endif
 
 typedef u_int SOCKET;
@@ -501,6 +501,7 @@ bool CAddrDB::Write(const CAddrMan& addr)
 
     // serialize addresses, checksum data up to that point, then append csum
     CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers.reserve(addr.size() * 64 + 256 * 1024); // a little over the typical size
     ssPeers << FLATDATA(pchMessageStart);
     ssPeers << addr;
     uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
@@ -538,18 +539,19 @@ bool CAddrDB::Read(CAddrMan& addr)
     if (!filein)
         return error("CAddrman::Read() : open failed");
 
-    // use file size to size memory buffer
+    // use file size to size memory buffer, and read straight into the stream
     int fileSize = GetFilesize(filein);
     int dataSize = fileSize - sizeof(uint256);
     //Don't try to resize to a negative number if file is small
     if ( dataSize < 0 ) dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers.resize(dataSize);
     uint256 hashIn;
 
     // read data and checksum from file
     try {
-        filein.read((char *)&vchData[0], dataSize);
+        if (dataSize > 0)
+            filein.read(&ssPeers[0], dataSize);
         filein >> hashIn;
     }
     catch (std::exception &e) {
@@ -557,8 +559,6 @@ bool CAddrDB::Read(CAddrMan& addr)
     }
     filein.fclose();
 
-    CDataStream ssPeers(vchData, SER_DISK, CLIENT_VERSION);
-
     // verify stored checksum matches input data
     uint256 hashTmp = Hash(ssPeers.begin(), ssPeers.end());
     if (hashIn != hashTmp)
@@ -1,10 +1,23 @@
 #include "hash.h"
 
+#include <string.h>
+
 inline uint32_t ROTL32 ( uint32_t x, int8_t r )
 {
     return (x << r) | (x >> (32 - r));
 }
 
+#define ROTL64(x, b) (uint64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; \
+    v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; \
+    v2 = ROTL64(v2, 32); \
+} while (0)
+
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash)
 {
     // The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
@@ -56,3 +69,88 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
     return h1;
 }
+
+// Block mixing doesn't depend on the seed, so it is done once per 4 bytes of
+// data and applied to every hash state. The loops over the states have no
+// dependencies between iterations, which lets the compiler vectorise them.
+void MurmurHash3Multi(unsigned int nSeed, unsigned int nSeedStep, const unsigned char* pbegin, const unsigned char* pend,
+                      unsigned int* pnHash, unsigned int nHashes)
+{
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    const uint32_t nLen = pend - pbegin;
+
+    for (unsigned int i = 0; i < nHashes; i++)
+        pnHash[i] = nSeed + i * nSeedStep;
+
+    //----------
+    // body
+    const unsigned char* pc = pbegin;
+    for (; pend - pc >= 4; pc += 4)
+    {
+        uint32_t k1;
+        memcpy(&k1, pc, 4);
+
+        k1 *= c1;
+        k1 = ROTL32(k1,15);
+        k1 *= c2;
+
+        for (unsigned int i = 0; i < nHashes; i++)
+        {
+            uint32_t h1 = pnHash[i] ^ k1;
+            h1 = ROTL32(h1,13);
+            pnHash[i] = h1*5+0xe6546b64;
+        }
+    }
+
+    //----------
+    // tail
+    uint32_t k1 = 0;
+
+    switch(nLen & 3)
+    {
+    case 3: k1 ^= pc[2] << 16;
+    case 2: k1 ^= pc[1] << 8;
+    case 1: k1 ^= pc[0];
+            k1 *= c1; k1 = ROTL32(k1,15); k1 *= c2;
+    };
+
+    //----------
+    // finalization
+    for (unsigned int i = 0; i < nHashes; i++)
+    {
+        uint32_t h1 = pnHash[i] ^ k1 ^ nLen;
+        h1 ^= h1 >> 16;
+        h1 *= 0x85ebca6b;
+        h1 ^= h1 >> 13;
+        h1 *= 0xc2b2ae35;
+        h1 ^= h1 >> 16;
+        pnHash[i] = h1;
+    }
+}
+
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val)
+{
+    // SipHash-2-4 (see https://131002.net/siphash/) specialised to a 32 byte
+    // message, which is four little-endian words plus the length block
+    uint64 v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64 v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64 v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64 v3 = 0x7465646279746573ULL ^ k1;
+
+    for (int i = 0; i < 5; i++)
+    {
+        uint64 m = (i < 4) ? val.Get64(i) : ((uint64)32) << 56;
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -123,4 +123,12 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** MurmurHash3 of [pbegin, pend) under the nHashes seeds nSeed + i * nSeedStep,
+ *  computed in a single pass over the data; pnHash[i] receives the i'th hash */
+void MurmurHash3Multi(unsigned int nSeed, unsigned int nSeedStep, const unsigned char* pbegin, const unsigned char* pend,
+                      unsigned int* pnHash, unsigned int nHashes);
+
+/** SipHash-2-4 of a 256-bit value, with key (k0, k1) */
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val);
+
 #endif
@@ -86,8 +86,6 @@ bool ShutdownRequested()
     return fRequestShutdown;
 }
 
-static CCoinsViewDB *pcoinsdbview;
-
 void Shutdown()
 {
     static CCriticalSection cs_Shutdown;
@@ -304,6 +302,10 @@ std::string HelpMessage()
         "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n" +
         "  -port=<port>           " + _("Listen for connections on <port> (default: 8333 or testnet: 18333)") + "\n" +
         "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n" +
+        "  -maxconnecting=<n>     " + _("Make up to <n> outbound connection attempts at once (default: 8)") + "\n" +
+        "  -msgthreads=<n>        " + _("Set the number of message handler threads (up to 16, 0 = auto, default: 0)") + "\n" +
+        "  -trickleinbound=<n>    " + _("Average delay between transaction announcements to inbound peers, in milliseconds (default: 5000)") + "\n" +
+        "  -trickleoutbound=<n>   " + _("Average delay between transaction announcements to outbound peers, in milliseconds (default: 2000)") + "\n" +
         "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n" +
         "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n" +
         "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n" +
@@ -318,6 +320,7 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -maxuploadtarget=<n>   " + _("Try to keep upload below <n> MiB per 24h; blocks older than a week stop being served when it is near (0 = no limit, default: 0)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -534,7 +537,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
+#ifdef USE_EPOLL
+    nMaxConnections = std::max(nMaxConnections, 0);
+#else
+    // select() cannot watch more than FD_SETSIZE sockets
     nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#endif
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -555,6 +563,24 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // -msgthreads=0 means one thread per core, up to 4: beyond that they mostly wait for cs_main
+    nMessageHandlerThreads = GetArg("-msgthreads", 0);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads = std::min((int)boost::thread::hardware_concurrency(), 4);
+    nMessageHandlerThreads = std::max(std::min(nMessageHandlerThreads, MAX_MESSAGEHANDLER_THREADS), 1);
+
+    nMaxConnecting = std::max((int)GetArg("-maxconnecting", DEFAULT_MAX_CONNECTING), 1);
+
+    nTrickleInbound = std::max((int)GetArg("-trickleinbound", DEFAULT_TRICKLE_INBOUND), 0);
+    nTrickleOutbound = std::max((int)GetArg("-trickleoutbound", DEFAULT_TRICKLE_OUTBOUND), 0);
+
+    // New blocks are always served, so a target below a day's worth of them can't be met
+    int64 nMaxUploadTarget = std::max(GetArg("-maxuploadtarget", 0), (int64)0);
+    if (nMaxUploadTarget > 0 && nMaxUploadTarget * 1024 * 1024 < MAX_UPLOAD_TIMEFRAME / 600 * MAX_BLOCK_SIZE)
+        InitWarning(strprintf(_("Warning: -maxuploadtarget is below the %d MiB needed to serve new blocks for 24h; old blocks will never be served."),
+                              (int)(MAX_UPLOAD_TIMEFRAME / 600 * MAX_BLOCK_SIZE / 1024 / 1024)));
+    CNode::SetMaxOutboundTarget(nMaxUploadTarget * 1024 * 1024);
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -840,6 +866,22 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
 
+    // LevelDB profiles: both databases start from the default recipe for their cache share
+    CLevelDBProfile profileBlockTree(nBlockTreeDBCache);
+    CLevelDBProfile profileCoins(nCoinDBCache);
+    // descriptors left over after the connection budget are split between both databases
+    int nDBOpenFiles = std::min(64 + std::max(nFD - MIN_CORE_FILEDESCRIPTORS - nMaxConnections - nBind, 0) / 2, 1000);
+    profileBlockTree.nMaxOpenFiles = nDBOpenFiles;
+    profileCoins.nMaxOpenFiles = nDBOpenFiles;
+    // the block index is mostly scanned sequentially at startup, so use larger table blocks
+    profileBlockTree.nBlockSize = 16384;
+    // the chainstate is mostly written during initial download; trade block cache for bigger
+    // memtables then, so fewer and larger level-0 files are produced
+    if (fReindex || !boost::filesystem::exists(GetDataDir() / "chainstate")) {
+        profileCoins.nBlockCacheSize = nCoinDBCache / 4;
+        profileCoins.nWriteBufferSize = nCoinDBCache * 3 / 8;
+    }
+
     bool fLoaded = false;
     while (!fLoaded) {
         bool fReset = fReindex;
@@ -855,8 +897,8 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pcoinsdbview;
                 delete pblocktree;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                pblocktree = new CBlockTreeDB(profileBlockTree, false, fReindex);
+                pcoinsdbview = new CCoinsViewDB(profileCoins, false, fReindex);
                 pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
 
                 if (fReindex)
@@ -892,6 +934,10 @@ bool AppInit2(boost::thread_group& threadGroup)
         } while(false);
 
         if (!fLoaded) {
+            // loading was cut short by a shutdown request, exit below
+            if (fRequestShutdown)
+                break;
+
             // first suggest a reindex
             if (!fReset) {
                 bool fRet = uiInterface.ThreadSafeMessageBox(
@@ -909,9 +955,6 @@ bool AppInit2(boost::thread_group& threadGroup)
         }
     }
 
-    if (mapArgs.count("-txindex") && fTxIndex != GetBoolArg("-txindex", false))
-        return InitError(_("You need to rebuild the databases using -reindex to change -txindex"));
-
     // as LoadBlockIndex can take several minutes, it's possible the user
     // requested to kill bitcoin-qt during the last operation. If so, exit.
     // As the program has not fully started yet, Shutdown() is possibly overkill.
@@ -920,6 +963,9 @@ bool AppInit2(boost::thread_group& threadGroup)
         printf("Shutdown requested. Exiting.\n");
         return false;
     }
+
+    if (mapArgs.count("-txindex") && fTxIndex != GetBoolArg("-txindex", false))
+        return InitError(_("You need to rebuild the databases using -reindex to change -txindex"));
     printf(" block index %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
@@ -932,7 +978,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -24,23 +24,38 @@ void HandleError(const leveldb::Status &status) throw(leveldb_error) {
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize) {
+std::string CLevelDBProfile::ToString() const {
+    return strprintf("cache=%uKiB writebuffer=%uKiB blocksize=%u bloombits=%d maxopenfiles=%d",
+        (unsigned int)(nBlockCacheSize >> 10), (unsigned int)(nWriteBufferSize >> 10),
+        (unsigned int)nBlockSize, nBloomBits, nMaxOpenFiles);
+}
+
+static leveldb::Options GetOptions(const CLevelDBProfile &profile) {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    options.block_cache = leveldb::NewLRUCache(profile.nBlockCacheSize);
+    options.write_buffer_size = profile.nWriteBufferSize;
+    options.block_size = profile.nBlockSize;
+    options.filter_policy = profile.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(profile.nBloomBits) : NULL;
     options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.max_open_files = profile.nMaxOpenFiles;
     return options;
 }
 
 CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory, bool fWipe) {
+    Open(path, CLevelDBProfile(nCacheSize), fMemory, fWipe);
+}
+
+CLevelDB::CLevelDB(const boost::filesystem::path &path, const CLevelDBProfile &profile, bool fMemory, bool fWipe) {
+    Open(path, profile, fMemory, fWipe);
+}
+
+void CLevelDB::Open(const boost::filesystem::path &path, const CLevelDBProfile &profile, bool fMemory, bool fWipe) {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(profile);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -51,7 +66,7 @@ CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool
             leveldb::DestroyDB(path.string(), options);
         }
         boost::filesystem::create_directory(path);
-        printf("Opening LevelDB in %s\n", path.string().c_str());
+        printf("Opening LevelDB in %s (%s)\n", path.string().c_str(), profile.ToString().c_str());
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     if (!status.ok())
@@ -79,3 +94,9 @@ bool CLevelDB::WriteBatch(CLevelDBBatch &batch, bool fSync) throw(leveldb_error)
     }
     return true;
 }
+
+void CLevelDB::Compact() {
+    int64 nStart = GetTimeMillis();
+    pdb->CompactRange(NULL, NULL);
+    printf("LevelDB compaction done (%"PRI64d"ms)\n", GetTimeMillis() - nStart);
+}
@@ -19,6 +19,120 @@ public:
 
 void HandleError(const leveldb::Status &status) throw(leveldb_error);
 
+/** Tuning parameters for a single CLevelDB instance.
+ *  The default profile derived from a cache size matches the recipe used for all
+ *  databases so far; init.cpp adjusts the fields per database before opening it.
+ */
+struct CLevelDBProfile
+{
+    // size of the LRU cache for uncompressed table blocks
+    size_t nBlockCacheSize;
+
+    // size of a memtable; up to two may be held in memory simultaneously
+    size_t nWriteBufferSize;
+
+    // approximate size of user data packed per table block
+    size_t nBlockSize;
+
+    // bits per key for the bloom filter (0 disables the filter)
+    int nBloomBits;
+
+    // number of table files LevelDB may keep open
+    int nMaxOpenFiles;
+
+    CLevelDBProfile(size_t nCacheSize = 0)
+    {
+        nBlockCacheSize = nCacheSize / 2;
+        nWriteBufferSize = nCacheSize / 4;
+        nBlockSize = 4096;
+        nBloomBits = 10;
+        nMaxOpenFiles = 64;
+    }
+
+    std::string ToString() const;
+};
+
+/** Serialization target for LevelDB keys and values.
+ *  Small records (such as ('c', txid) keys) are written into an inline buffer
+ *  on the stack; only larger ones spill over into a heap vector, which is kept
+ *  around for reuse when the writer is cleared.
+ */
+class CLevelDBWriter
+{
+private:
+    char pchInline[64];
+    std::vector<char> vchSpill;
+    size_t nSize;
+
+public:
+    int nType;
+    int nVersion;
+
+    CLevelDBWriter() : nSize(0), nType(SER_DISK), nVersion(CLIENT_VERSION) {}
+
+    void clear() {
+        nSize = 0;
+        vchSpill.clear();
+    }
+
+    CLevelDBWriter& write(const char *pch, size_t nLen) {
+        if (vchSpill.empty() && nSize + nLen <= sizeof(pchInline)) {
+            memcpy(pchInline + nSize, pch, nLen);
+        } else {
+            if (vchSpill.empty())
+                vchSpill.assign(pchInline, pchInline + nSize);
+            vchSpill.insert(vchSpill.end(), pch, pch + nLen);
+        }
+        nSize += nLen;
+        return (*this);
+    }
+
+    template<typename T>
+    CLevelDBWriter& operator<<(const T& obj) {
+        // Serialize to this stream
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    // only valid until the next write or clear
+    leveldb::Slice GetSlice() const {
+        return leveldb::Slice(vchSpill.empty() ? pchInline : &vchSpill[0], nSize);
+    }
+};
+
+/** Read-only stream over memory owned by LevelDB (or a std::string returned by it),
+ *  so values can be deserialized in place rather than copied into a CDataStream first.
+ */
+class CLevelDBReader
+{
+private:
+    const char *pch;
+    const char *pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CLevelDBReader(const leveldb::Slice &slice) : pch(slice.data()), pend(slice.data() + slice.size()), nType(SER_DISK), nVersion(CLIENT_VERSION) {}
+
+    bool empty() const { return pch == pend; }
+
+    CLevelDBReader& read(char *pchOut, size_t nLen) {
+        if (nLen > (size_t)(pend - pch))
+            throw std::ios_base::failure("CLevelDBReader::read() : end of data");
+        memcpy(pchOut, pch, nLen);
+        pch += nLen;
+        return (*this);
+    }
+
+    template<typename T>
+    CLevelDBReader& operator>>(T& obj) {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 // Batch of changes queued to be written to a CLevelDB
 class CLevelDBBatch
 {
@@ -27,28 +141,37 @@ class CLevelDBBatch
 private:
     leveldb::WriteBatch batch;
 
+    // scratch buffers, reused for every entry (WriteBatch copies the data)
+    CLevelDBWriter ssKey;
+    CLevelDBWriter ssValue;
+
+    // approximate number of bytes queued
+    size_t nSizeEstimate;
+
 public:
+    CLevelDBBatch() : nSizeEstimate(0) {}
+
     template<typename K, typename V> void Write(const K& key, const V& value) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey.clear();
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
-
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.reserve(ssValue.GetSerializeSize(value));
+        ssValue.clear();
         ssValue << value;
-        leveldb::Slice slValue(&ssValue[0], ssValue.size());
-
-        batch.Put(slKey, slValue);
+        batch.Put(ssKey.GetSlice(), ssValue.GetSlice());
+        nSizeEstimate += ssKey.GetSlice().size() + ssValue.GetSlice().size() + 8;
     }
 
     template<typename K> void Erase(const K& key) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey.clear();
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+        batch.Delete(ssKey.GetSlice());
+        nSizeEstimate += ssKey.GetSlice().size() + 4;
+    }
+
+    size_t SizeEstimate() const { return nSizeEstimate; }
 
-        batch.Delete(slKey);
+    void Clear() {
+        batch.Clear();
+        nSizeEstimate = 0;
     }
 };
 
@@ -76,18 +199,19 @@ private:
     // the database itself
     leveldb::DB *pdb;
 
+    void Open(const boost::filesystem::path &path, const CLevelDBProfile &profile, bool fMemory, bool fWipe);
+
 public:
     CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDB(const boost::filesystem::path &path, const CLevelDBProfile &profile, bool fMemory = false, bool fWipe = false);
     ~CLevelDB();
 
     template<typename K, typename V> bool Read(const K& key, V& value) throw(leveldb_error) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
+        CLevelDBWriter ssKey;
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(readoptions, ssKey.GetSlice(), &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -95,7 +219,7 @@ public:
             HandleError(status);
         }
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            CLevelDBReader ssValue(strValue);
             ssValue >> value;
         } catch(std::exception &e) {
             return false;
@@ -110,13 +234,11 @@ public:
     }
 
     template<typename K> bool Exists(const K& key) throw(leveldb_error) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
+        CLevelDBWriter ssKey;
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(readoptions, ssKey.GetSlice(), &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -144,6 +266,9 @@ public:
         return WriteBatch(batch, true);
     }
 
+    // compact the whole key range, pushing everything to the lowest possible level
+    void Compact();
+
     // not exactly clean encapsulation, but it's easiest for now
     leveldb::Iterator *NewIterator() {
         return pdb->NewIterator(iteroptions);
@@ -14,6 +14,7 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread/once.hpp>
 
 using namespace std;
 using namespace boost;
@@ -30,8 +31,55 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+/** Allocates CBlockIndex objects in large contiguous chunks. Block index entries are
+ *  never freed individually, so this saves the per-object heap overhead and keeps
+ *  entries that were created together (e.g. while loading) close in memory.
+ *  Chunks start on a cache line boundary; entries within a chunk are packed,
+ *  since padding each one to whole cache lines would cost about 40% more
+ *  memory for the block index. */
+class CBlockIndexArena
+{
+private:
+    static const unsigned int nChunkSize = 4096;
+    static const size_t nAlign = 64;
+    std::vector<char*> vChunks;
+    CBlockIndex *pnext;  // next free entry in the last chunk
+    unsigned int nFree;  // number of free entries left in the last chunk
+
+public:
+    CBlockIndexArena() : pnext(NULL), nFree(0) {}
+
+    ~CBlockIndexArena() {
+        // CBlockIndex is trivially destructible
+        BOOST_FOREACH(char *pchunk, vChunks)
+            delete[] pchunk;
+    }
+
+    CBlockIndex *Allocate() {
+        if (nFree == 0) {
+            char *pchunk = new char[nChunkSize * sizeof(CBlockIndex) + nAlign];
+            vChunks.push_back(pchunk);
+            pnext = (CBlockIndex*)(pchunk + (nAlign - (size_t)pchunk % nAlign) % nAlign);
+            nFree = nChunkSize;
+        }
+        nFree--;
+        return new (pnext++) CBlockIndex();
+    }
+
+    size_t GetAllocatedBytes() const {
+        return vChunks.size() * (nChunkSize * sizeof(CBlockIndex) + nAlign);
+    }
+};
+
+static CBlockIndexArena arenaBlockIndex; // protected by cs_main
+BlockMap mapBlockIndex;
 std::vector<CBlockIndex*> vBlockIndexByHeight;
+
+size_t GetBlockIndexMemoryUsage()
+{
+    return arenaBlockIndex.GetAllocatedBytes();
+}
+
 uint256 hashGenesisBlock("0x000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
 CBlockIndex* pindexGenesisBlock = NULL;
@@ -40,7 +88,9 @@ uint256 nBestChainWork = 0;
 uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CBlockIndex* pindexBestHeader = NULL; // tip of the most-work chain of headers
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
+multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked; // blocks with data whose ancestors don't all have data yet, by parent
 int64 nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
 bool fImporting = false;
@@ -59,6 +109,17 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
+// Blocks queued for parallel download, in chain order, and the peers the
+// ones in flight were requested from
+list<uint256> lBlocksToDownload;
+map<uint256, list<uint256>::iterator> mapBlocksToDownload;
+map<uint256, CNode*> mapBlocksInFlight;
+// Download rate of the fastest peer, decaying so that it follows the peers we have
+double dBestBlockDownloadRate = 0;
+
+// Compact blocks waiting for "blocktxn", one per peer
+map<CNode*, CPartialBlock> mapPartialBlocks;
+
 map<uint256, CDataStream*> mapOrphanTransactions;
 map<uint256, map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
 
@@ -526,7 +587,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -857,6 +918,7 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
+            mapTxMessage.erase(hash);
             nTransactionsUpdated++;
         }
     }
@@ -883,9 +945,23 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapTxMessage.clear();
     ++nTransactionsUpdated;
 }
 
+CSerializedMessage CTxMemPool::lookupMessage(const uint256& hash)
+{
+    std::map<uint256, CSerializedMessage>::iterator mi = mapTxMessage.find(hash);
+    if (mi != mapTxMessage.end())
+        return mi->second;
+    std::map<uint256, CTransaction>::iterator it = mapTx.find(hash);
+    if (it == mapTx.end())
+        return CSerializedMessage();
+    CSerializedMessage msg = MakeMessage("tx", it->second);
+    mapTxMessage.insert(make_pair(hash, msg));
+    return msg;
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
@@ -905,7 +981,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1213,7 +1289,7 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
     printf("InvalidChainFound:  current best=%s  height=%d  log2_work=%.8g  date=%s\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0),
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
         printf("InvalidChainFound: Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.\n");
 }
 
@@ -1221,6 +1297,28 @@ void static InvalidBlockFound(CBlockIndex *pindex) {
     pindex->nStatus |= BLOCK_FAILED_VALID;
     pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
     setBlockIndexValid.erase(pindex);
+
+    // Headers already accepted on top of it fail too, and the best header
+    // may have been one of them
+    CBlockIndex* pindexBestValidHeader = NULL;
+    BOOST_FOREACH(BlockMap::value_type& item, mapBlockIndex)
+    {
+        CBlockIndex* pindexWalk = item.second;
+        if (pindexWalk->nHeight > pindex->nHeight && pindexWalk->GetAncestor(pindex->nHeight) == pindex)
+        {
+            if (!(pindexWalk->nStatus & BLOCK_FAILED_CHILD))
+            {
+                pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
+                pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexWalk));
+                setBlockIndexValid.erase(pindexWalk);
+            }
+        }
+        else if (!(pindexWalk->nStatus & BLOCK_FAILED_MASK) &&
+                 (pindexBestValidHeader == NULL || pindexWalk->nChainWork > pindexBestValidHeader->nChainWork))
+            pindexBestValidHeader = pindexWalk;
+    }
+    if (pindexBestHeader && (pindexBestHeader->nStatus & BLOCK_FAILED_MASK))
+        pindexBestHeader = pindexBestValidHeader;
     InvalidChainFound(pindex);
     if (pindex->GetNextInMainChain()) {
         CValidationState stateDummy;
@@ -1740,16 +1838,19 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // Find the fork (typically, there is none)
     CBlockIndex* pfork = view.GetBestBlock();
     CBlockIndex* plonger = pindexNew;
-    while (pfork && pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight) {
+    if (pfork) {
+        // Bring both sides to the same height, then walk back in lockstep
+        if (plonger->nHeight > pfork->nHeight)
+            plonger = plonger->GetAncestor(pfork->nHeight);
+        else if (pfork->nHeight > plonger->nHeight)
+            pfork = pfork->GetAncestor(plonger->nHeight);
+        assert(plonger != NULL && pfork != NULL);
+        while (pfork != plonger)
+        {
+            pfork = pfork->pprev;
             plonger = plonger->pprev;
-            assert(plonger != NULL);
+            assert(pfork != NULL && plonger != NULL);
         }
-        if (pfork == plonger)
-            break;
-        pfork = pfork->pprev;
-        assert(pfork != NULL);
     }
 
     // List of what to disconnect (typically nothing)
@@ -1905,32 +2006,70 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 }
 
 
-bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
+static CBlockIndex* AddHeaderToBlockIndex(const CBlockHeader& header)
 {
-    // Check for duplicate
-    uint256 hash = GetHash();
-    if (mapBlockIndex.count(hash))
-        return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
-
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(*this);
-    assert(pindexNew);
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockIndex* pindexNew = arenaBlockIndex.Allocate();
+    *pindexNew = CBlockIndex(header);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(header.GetHash(), pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(header.hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
-    }
+        pindexNew->BuildSkip();
+    }
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork();
+    pindexNew->nStatus = BLOCK_VALID_TREE;
+    if (pindexNew->pprev && (pindexNew->pprev->nStatus & BLOCK_FAILED_MASK))
+        pindexNew->nStatus |= BLOCK_FAILED_CHILD;
+    else if (pindexBestHeader == NULL || pindexNew->nChainWork > pindexBestHeader->nChainWork)
+        pindexBestHeader = pindexNew;
+    return pindexNew;
+}
+
+bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
+{
+    // Check for duplicate; the header may already be known
+    uint256 hash = GetHash();
+    CBlockIndex* pindexNew = NULL;
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        pindexNew = (*mi).second;
+    else
+        pindexNew = AddHeaderToBlockIndex(*this);
+    if (pindexNew->nStatus & BLOCK_HAVE_DATA)
+        return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
+
     pindexNew->nTx = vtx.size();
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
-    pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0) + pindexNew->nTx;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
-    pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
-    setBlockIndexValid.insert(pindexNew);
+    pindexNew->nStatus = (pindexNew->nStatus & ~BLOCK_VALID_MASK) | BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
+
+    // Blocks may arrive before their parents. A block only gets nChainTx and
+    // becomes a candidate tip once all its ancestors have data; then so do the
+    // descendants that were waiting on it.
+    if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx)
+    {
+        deque<CBlockIndex*> queue;
+        queue.push_back(pindexNew);
+        while (!queue.empty())
+        {
+            CBlockIndex* pindex = queue.front();
+            queue.pop_front();
+            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            if (!(pindex->nStatus & BLOCK_FAILED_MASK))
+                setBlockIndexValid.insert(pindex);
+            pair<multimap<CBlockIndex*, CBlockIndex*>::iterator, multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+            for (multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first; it != range.second; ++it)
+                queue.push_back((*it).second);
+            mapBlocksUnlinked.erase(range.first, range.second);
+        }
+    }
+    else
+        mapBlocksUnlinked.insert(make_pair(pindexNew->pprev, pindexNew));
 
     if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
         return state.Abort(_("Failed to write block index"));
@@ -2059,13 +2198,8 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return state.DoS(100, error("CheckBlock() : size limits failed"));
 
-    // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(GetHash(), nBits))
-        return state.DoS(50, error("CheckBlock() : proof of work failed"));
-
-    // Check timestamp
-    if (GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
-        return state.Invalid(error("CheckBlock() : block timestamp too far in the future"));
+    if (!CheckBlockHeader(state, fCheckPOW))
+        return false;
 
     // First transaction must be coinbase, the rest must not be
     if (vtx.empty() || !vtx[0].IsCoinBase())
@@ -2108,39 +2242,62 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     return true;
 }
 
-bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
+bool CBlockHeader::CheckBlockHeader(CValidationState &state, bool fCheckPOW) const
+{
+    // Check proof of work matches claimed amount
+    if (fCheckPOW && !CheckProofOfWork(GetHash(), nBits))
+        return state.DoS(50, error("CheckBlockHeader() : proof of work failed"));
+
+    // Check timestamp
+    if (GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return state.Invalid(error("CheckBlockHeader() : block timestamp too far in the future"));
+
+    return true;
+}
+
+bool CBlockHeader::AcceptBlockHeader(CValidationState &state, CBlockIndex **ppindex) const
 {
     // Check for duplicate
     uint256 hash = GetHash();
-    if (mapBlockIndex.count(hash))
-        return state.Invalid(error("AcceptBlock() : block already in mapBlockIndex"));
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+    {
+        if (ppindex)
+            *ppindex = (*mi).second;
+        if ((*mi).second->nStatus & BLOCK_FAILED_MASK)
+            return state.Invalid(error("AcceptBlockHeader() : block %s is marked invalid", hash.ToString().c_str()));
+        return true;
+    }
+
+    if (!CheckBlockHeader(state))
+        return false;
 
     // Get prev block index
-    CBlockIndex* pindexPrev = NULL;
-    int nHeight = 0;
     if (hash != hashGenesisBlock) {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+        mi = mapBlockIndex.find(hashPrevBlock);
         if (mi == mapBlockIndex.end())
-            return state.DoS(10, error("AcceptBlock() : prev block not found"));
-        pindexPrev = (*mi).second;
-        nHeight = pindexPrev->nHeight+1;
+            return state.DoS(10, error("AcceptBlockHeader() : prev block not found"));
+        CBlockIndex* pindexPrev = (*mi).second;
+        int nHeight = pindexPrev->nHeight+1;
+        if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+            return state.DoS(100, error("AcceptBlockHeader() : prev block invalid"));
 
         // Check proof of work
         if (nBits != GetNextWorkRequired(pindexPrev, this))
-            return state.DoS(100, error("AcceptBlock() : incorrect proof of work"));
+            return state.DoS(100, error("AcceptBlockHeader() : incorrect proof of work"));
 
         // Check timestamp against prev
         if (GetBlockTime() <= pindexPrev->GetMedianTimePast())
-            return state.Invalid(error("AcceptBlock() : block's timestamp is too early"));
-
-        // Check that all transactions are finalized
-        BOOST_FOREACH(const CTransaction& tx, vtx)
-            if (!tx.IsFinal(nHeight, GetBlockTime()))
-                return state.DoS(10, error("AcceptBlock() : contains a non-final transaction"));
+            return state.Invalid(error("AcceptBlockHeader() : block's timestamp is too early"));
 
         // Check that the block chain matches the known block chain up to a checkpoint
         if (!Checkpoints::CheckBlock(nHeight, hash))
-            return state.DoS(100, error("AcceptBlock() : rejected by checkpoint lock-in at %d", nHeight));
+            return state.DoS(100, error("AcceptBlockHeader() : rejected by checkpoint lock-in at %d", nHeight));
+
+        // Don't accept any forks from the main chain prior to last checkpoint
+        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
+        if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+            return state.DoS(100, error("AcceptBlockHeader() : forked chain older than last checkpoint (height %d)", nHeight));
 
         // Reject block.nVersion=1 blocks when 95% (75% on testnet) of the network has upgraded:
         if (nVersion < 2)
@@ -2148,19 +2305,50 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
             if ((!fTestNet && CBlockIndex::IsSuperMajority(2, pindexPrev, 950, 1000)) ||
                 (fTestNet && CBlockIndex::IsSuperMajority(2, pindexPrev, 75, 100)))
             {
-                return state.Invalid(error("AcceptBlock() : rejected nVersion=1 block"));
+                return state.Invalid(error("AcceptBlockHeader() : rejected nVersion=1 block"));
             }
         }
+    }
+
+    CBlockIndex* pindexNew = AddHeaderToBlockIndex(*this);
+    if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
+        return state.Abort(_("Failed to write block index"));
+    if (ppindex)
+        *ppindex = pindexNew;
+    return true;
+}
+
+bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
+{
+    // Check the header, and get or create its index entry
+    CBlockIndex* pindex = NULL;
+    if (!AcceptBlockHeader(state, &pindex))
+        return error("AcceptBlock() : AcceptBlockHeader FAILED");
+    if (pindex->nStatus & BLOCK_HAVE_DATA)
+        return state.Invalid(error("AcceptBlock() : block already in mapBlockIndex"));
+
+    uint256 hash = GetHash();
+    int nHeight = pindex->nHeight;
+    if (pindex->pprev) {
+        // Check that all transactions are finalized
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+            if (!tx.IsFinal(nHeight, GetBlockTime())) {
+                InvalidBlockFound(pindex);
+                return state.DoS(10, error("AcceptBlock() : contains a non-final transaction"));
+            }
+
         // Enforce block.nVersion=2 rule that the coinbase starts with serialized block height
         if (nVersion >= 2)
         {
             // if 750 of the last 1,000 blocks are version 2 or greater (51/100 if testnet):
-            if ((!fTestNet && CBlockIndex::IsSuperMajority(2, pindexPrev, 750, 1000)) ||
-                (fTestNet && CBlockIndex::IsSuperMajority(2, pindexPrev, 51, 100)))
+            if ((!fTestNet && CBlockIndex::IsSuperMajority(2, pindex->pprev, 750, 1000)) ||
+                (fTestNet && CBlockIndex::IsSuperMajority(2, pindex->pprev, 51, 100)))
             {
                 CScript expect = CScript() << nHeight;
-                if (!std::equal(expect.begin(), expect.end(), vtx[0].vin[0].scriptSig.begin()))
+                if (!std::equal(expect.begin(), expect.end(), vtx[0].vin[0].scriptSig.begin())) {
+                    InvalidBlockFound(pindex);
                     return state.DoS(100, error("AcceptBlock() : block height mismatch in coinbase"));
+                }
             }
         }
     }
@@ -2182,14 +2370,33 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
         return state.Abort(_("System error: ") + e.what());
     }
 
-    // Relay inventory, but don't relay old inventory during initial block download
+    // Relay inventory, but don't relay old inventory during initial block download.
+    // Peers that asked for compact blocks get one instead of the inv.
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        CInv inv(MSG_BLOCK, hash);
+        CSerializedMessage msgCompact;
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (!pnode->fPreferCompactBlocks)
+            {
+                pnode->PushInventory(inv);
+                continue;
+            }
+            {
+                LOCK(pnode->cs_inventory);
+                if (pnode->filterInventoryKnown.contains(inv.hash))
+                    continue;
+                pnode->filterInventoryKnown.insert(inv.hash);
+            }
+            if (!msgCompact)
+                msgCompact = MakeMessage("cmpctblock", CBlockHeaderAndShortTxIDs(*this));
+            pnode->PushSharedMessage(msgCompact);
+        }
     }
 
     return true;
@@ -2200,6 +2407,9 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     unsigned int nFound = 0;
     for (unsigned int i = 0; i < nToCheck && nFound < nRequired && pstart != NULL; i++)
     {
+        // Give up as soon as the remaining blocks can no longer make up the difference
+        if (nFound + (nToCheck - i) < nRequired)
+            break;
         if (pstart->nVersion >= minVersion)
             ++nFound;
         pstart = pstart->pprev;
@@ -2207,12 +2417,60 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
+/** Turn the lowest '1' bit in the binary representation of a number into a '0'. */
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+/** Compute what height to jump back to with the CBlockIndex::pskip pointer. */
+static inline int GetSkipHeight(int height) {
+    if (height < 2)
+        return 0;
+    // Any number strictly lower than height is acceptable, but this expression
+    // keeps walks short (at most ~110 steps to go back up to 2**18 blocks).
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int height)
+{
+    if (height > nHeight || height < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > height) {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (heightSkip == height ||
+            (heightSkip > height && !(heightSkipPrev < heightSkip - 2 &&
+                                      heightSkipPrev >= height))) {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev.
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int height) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(height);
+}
+
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
-        return state.Invalid(error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().c_str()));
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end() && ((*mi).second->nStatus & BLOCK_HAVE_DATA))
+        return state.Invalid(error("ProcessBlock() : already have block %d %s", (*mi).second->nHeight, hash.ToString().c_str()));
     if (mapOrphanBlocks.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
@@ -2220,7 +2478,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     if (!pblock->CheckBlock(state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
     if (pcheckpoint && pblock->hashPrevBlock != hashBestChain)
     {
         // Extra checks to prevent "fill up memory by spamming with bogus blocks"
@@ -2319,6 +2577,133 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
     txn = CPartialMerkleTree(vHashes, vMatch);
 }
 
+CMerkleBlock::CMerkleBlock(const CBlockHeader& headerIn, const vector<CBloomFilterElements>& vElements, CBloomFilter& filter)
+{
+    header = headerIn;
+
+    vector<bool> vMatch;
+    vector<uint256> vHashes;
+
+    vMatch.reserve(vElements.size());
+    vHashes.reserve(vElements.size());
+
+    for (unsigned int i = 0; i < vElements.size(); i++)
+    {
+        const uint256& hash = vElements[i].hash;
+        if (filter.IsRelevantAndUpdate(vElements[i]))
+        {
+            vMatch.push_back(true);
+            vMatchedTxn.push_back(make_pair(i, hash));
+        }
+        else
+            vMatch.push_back(false);
+        vHashes.push_back(hash);
+    }
+
+    txn = CPartialMerkleTree(vHashes, vMatch);
+}
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block)
+{
+    header = block.GetBlockHeader();
+    nNonce = GetRandHash().Get64();
+    FillShortIDKey();
+
+    // The coinbase is never in the receiver's pool
+    vPrefilledTxn.resize(1);
+    vPrefilledTxn[0].nIndex = 0;
+    vPrefilledTxn[0].tx = block.vtx[0];
+
+    vShortTxIDs.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIDs.push_back(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortIDKey()
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nNonce;
+    uint256 hashKey = Hash(ss.begin(), ss.end());
+    nShortIDKey0 = hashKey.Get64(0);
+    nShortIDKey1 = hashKey.Get64(1);
+}
+
+uint64 CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(nShortIDKey0, nShortIDKey1, txhash) & 0xffffffffffffULL;
+}
+
+bool CPartialBlock::Init(CValidationState &state, const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool)
+{
+    // Every transaction is at least 60 bytes
+    unsigned int nTx = cmpctblock.BlockTxCount();
+    if (nTx == 0 || nTx > MAX_BLOCK_SIZE / 60)
+        return state.DoS(100, error("CPartialBlock::Init() : bad transaction count %u", nTx));
+
+    header = cmpctblock.header;
+    vtx.assign(nTx, CTransaction());
+    vHave.assign(nTx, false);
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+    {
+        if (prefilled.nIndex >= nTx || vHave[prefilled.nIndex])
+            return state.DoS(100, error("CPartialBlock::Init() : bad prefilled transaction index"));
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // The short IDs fill the remaining positions in order
+    map<uint64, unsigned int> mapShortIDs;
+    unsigned int nIndex = 0;
+    BOOST_FOREACH(uint64 nShortID, cmpctblock.vShortTxIDs)
+    {
+        while (vHave[nIndex])
+            nIndex++;
+        if (!mapShortIDs.insert(make_pair(nShortID, nIndex++)).second)
+            return false;
+    }
+
+    vector<bool> vFromPool(nTx, false);
+    for (map<uint256, CTransaction>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it)
+    {
+        map<uint64, unsigned int>::iterator mi = mapShortIDs.find(cmpctblock.GetShortID((*it).first));
+        if (mi == mapShortIDs.end())
+            continue;
+        // Two pool transactions match one ID: can't tell which is meant
+        if (vFromPool[(*mi).second])
+            return false;
+        vtx[(*mi).second] = (*it).second;
+        vFromPool[(*mi).second] = true;
+        vHave[(*mi).second] = true;
+    }
+    return true;
+}
+
+void CPartialBlock::GetMissing(std::vector<unsigned int>& vIndexes) const
+{
+    vIndexes.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+bool CPartialBlock::Fill(const std::vector<CTransaction>& vMissing, CBlock& block) const
+{
+    block.SetNull();
+    *((CBlockHeader*)&block) = header;
+    block.vtx = vtx;
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nMissing >= vMissing.size())
+            return false;
+        block.vtx[i] = vMissing[nMissing++];
+    }
+    return nMissing == vMissing.size();
+}
+
 
 
 
@@ -2506,20 +2891,60 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = arenaBlockIndex.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+// Finish a chunked coin database write that was interrupted. Each coin entry
+// on disk is either as of the old best block or as of hashTarget, so the
+// blocks in between are applied again, in a way that doesn't mind seeing
+// their effects twice: outputs are recreated as of the block that creates
+// them (the later spends are replayed as well), and spending an output that
+// is already spent or gone does nothing.
+bool static ReplayInterruptedCoinsFlush(const uint256 &hashTarget)
+{
+    CBlockIndex *pindexOld = pcoinsTip->GetBestBlock();
+    BlockMap::iterator mi = mapBlockIndex.find(hashTarget);
+    if (pindexOld == NULL || mi == mapBlockIndex.end() || (*mi).second->GetAncestor(pindexOld->nHeight) != pindexOld)
+        return error("ReplayInterruptedCoinsFlush() : interrupted coin database write can't be replayed, -reindex needed");
+    CBlockIndex *pindexTarget = (*mi).second;
+
+    printf("Replaying blocks %d to %d to finish an interrupted coin database write...\n", pindexOld->nHeight + 1, pindexTarget->nHeight);
+    for (int nHeight = pindexOld->nHeight + 1; nHeight <= pindexTarget->nHeight; nHeight++)
+    {
+        boost::this_thread::interruption_point();
+        CBlockIndex *pindex = pindexTarget->GetAncestor(nHeight);
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("ReplayInterruptedCoinsFlush() : failed to read block %s", pindex->GetBlockHash().ToString().c_str());
+        BOOST_FOREACH(const CTransaction &tx, block.vtx)
+        {
+            if (!tx.IsCoinBase())
+            {
+                BOOST_FOREACH(const CTxIn &txin, tx.vin)
+                {
+                    if (!pcoinsTip->HaveCoins(txin.prevout.hash))
+                        continue;
+                    CTxInUndo undo;
+                    pcoinsTip->GetCoins(txin.prevout.hash).Spend(txin.prevout, undo);
+                }
+            }
+            pcoinsTip->SetCoins(tx.GetHash(), CCoins(tx, pindex->nHeight));
+        }
+    }
+    if (!pcoinsTip->SetBestBlock(pindexTarget) || !pcoinsTip->Flush())
+        return error("ReplayInterruptedCoinsFlush() : failed to write coin database");
+    return true;
+}
+
 bool static LoadBlockIndexDB()
 {
     if (!pblocktree->LoadBlockIndexGuts())
@@ -2527,7 +2952,8 @@ bool static LoadBlockIndexDB()
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
+    // Calculate nChainWork and build the skiplist pointers
+    int64 nStart = GetTimeMillis();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -2539,11 +2965,23 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
-        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork();
+        pindex->BuildSkip();
+        // nChainTx is only known once all ancestors have data
+        if (pindex->nStatus & BLOCK_HAVE_DATA)
+        {
+            if (pindex->pprev == NULL || pindex->pprev->nChainTx)
+                pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            else
+                mapBlocksUnlinked.insert(make_pair(pindex->pprev, pindex));
+        }
+        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK) && pindex->nChainTx)
             setBlockIndexValid.insert(pindex);
+        if (!(pindex->nStatus & BLOCK_FAILED_MASK) && (pindexBestHeader == NULL || pindex->nChainWork > pindexBestHeader->nChainWork))
+            pindexBestHeader = pindex;
     }
+    if (fDebug)
+        printf("LoadBlockIndexDB(): chain work calculated in %"PRI64d"ms\n", GetTimeMillis() - nStart);
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -2565,6 +3003,11 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     printf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // A chunked coin database flush that never completed leaves it half-updated
+    uint256 hashFlushTarget;
+    if (pcoinsdbview && pcoinsdbview->ReadBulkWriteTarget(hashFlushTarget) && !ReplayInterruptedCoinsFlush(hashFlushTarget))
+        return false;
+
     // Load hashBestChain pointer to end of best chain
     pindexBest = pcoinsTip->GetBestBlock();
     if (pindexBest == NULL)
@@ -2671,6 +3114,8 @@ void UnloadBlockIndex()
     nBestInvalidWork = 0;
     hashBestChain = 0;
     pindexBest = NULL;
+    pindexBestHeader = NULL;
+    mapBlocksUnlinked.clear();
 }
 
 bool LoadBlockIndex()
@@ -2770,7 +3215,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2810,7 +3255,10 @@ void PrintBlockTree()
 
         // print item
         CBlock block;
-        block.ReadFromDisk(pindex);
+        if (pindex->nStatus & BLOCK_HAVE_DATA)
+            block.ReadFromDisk(pindex);
+        else
+            block.nTime = pindex->nTime;
         printf("%d (blk%05u.dat:0x%x)  %s  tx %"PRIszu"",
             pindex->nHeight,
             pindex->GetBlockPos().nFile, pindex->GetBlockPos().nPos,
@@ -2945,7 +3393,7 @@ string GetWarnings(string strFor)
     }
 
     // Longer invalid proof-of-work chain
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
     {
         nPriority = 2000;
         strStatusBar = strRPC = _("Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.");
@@ -3001,13 +3449,224 @@ bool static AlreadyHave(const CInv& inv)
                 pcoinsTip->HaveCoins(inv.hash);
         }
     case MSG_BLOCK:
-        return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+        {
+            BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+            return (mi != mapBlockIndex.end() && ((*mi).second->nStatus & BLOCK_HAVE_DATA)) ||
+                   mapOrphanBlocks.count(inv.hash);
+        }
     }
     // Don't know what it is, just say we already got one
     return true;
 }
 
+// Only blocks whose header is in mapBlockIndex are queued: when they arrive
+// ahead of their parents, AcceptBlock stores them on disk instead of them
+// being held in memory as orphans
+void static QueueBlockDownload(const uint256& hash)
+{
+    if (mapBlocksToDownload.count(hash) || !mapBlockIndex.count(hash))
+        return;
+    list<uint256>::iterator it = lBlocksToDownload.insert(lBlocksToDownload.end(), hash);
+    mapBlocksToDownload.insert(make_pair(hash, it));
+}
+
+// Blocks fetched through a compact block count as in flight from pfrom like
+// requested ones. AskFor on other peers announcing the block is held off
+// for its retry delay, so they only get asked if pfrom doesn't deliver.
+void static MarkCompactBlockInFlight(CNode* pfrom, const CInv& inv)
+{
+    int64 nNow = GetTimeMicros();
+    pfrom->mapBlocksInFlight[inv.hash] = nNow;
+    mapBlocksInFlight[inv.hash] = pfrom;
+    if (!mapAlreadyAskedFor.count(inv))
+        mapAlreadyAskedFor.insert(make_pair(inv, nNow));
+}
+
+// Queue the blocks we miss between the active chain and the best header. The
+// "headers" handler only queues the stretches it receives, and the queue
+// doesn't survive a restart, so this picks up headers we had before.
+void static QueueMissingBlocks()
+{
+    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork <= nBestChainWork)
+        return;
+    vector<CBlockIndex*> vToFetch;
+    CBlockIndex* pindex = pindexBestHeader;
+    while (pindex && (pindex->nHeight > nBestHeight || pindexBest->GetAncestor(pindex->nHeight) != pindex))
+    {
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            vToFetch.push_back(pindex);
+        pindex = pindex->pprev;
+    }
+    BOOST_REVERSE_FOREACH(CBlockIndex* pindexFetch, vToFetch)
+        QueueBlockDownload(pindexFetch->GetBlockHash());
+}
+
+// Drop a block from the download queue once it arrived, from whichever peer
+void static MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, list<uint256>::iterator>::iterator itQueued = mapBlocksToDownload.find(hash);
+    if (itQueued != mapBlocksToDownload.end())
+    {
+        lBlocksToDownload.erase((*itQueued).second);
+        mapBlocksToDownload.erase(itQueued);
+    }
+    map<uint256, CNode*>::iterator itFlight = mapBlocksInFlight.find(hash);
+    if (itFlight != mapBlocksInFlight.end())
+    {
+        CNode* pnode = (*itFlight).second;
+        pnode->mapBlocksInFlight.erase(hash);
+        pnode->nStallingSince = 0;
+        mapBlocksInFlight.erase(itFlight);
+    }
+}
+
+// Blocks a deleted node still had in flight go back to the queue
+void FinalizeNode(CNode* pnode)
+{
+    for (map<uint256, int64>::iterator it = pnode->mapBlocksInFlight.begin(); it != pnode->mapBlocksInFlight.end(); ++it)
+        mapBlocksInFlight.erase((*it).first);
+    pnode->mapBlocksInFlight.clear();
+    mapPartialBlocks.erase(pnode);
+}
+
+// Fold a block we asked pfrom for into its download rate. Blocks requested
+// together arrive one after another, so each is timed from the later of its
+// request and the previous block's arrival.
+void static UpdateBlockDownloadRate(CNode* pfrom, const uint256& hash, unsigned int nSize)
+{
+    map<uint256, int64>::iterator it = pfrom->mapBlocksInFlight.find(hash);
+    if (it == pfrom->mapBlocksInFlight.end())
+        return;
+    int64 nNow = GetTimeMicros();
+    int64 nElapsed = nNow - std::max((*it).second, pfrom->nLastBlockRecvUsec);
+    pfrom->nLastBlockRecvUsec = nNow;
+    double dRate = nSize * 1000000.0 / std::max(nElapsed, (int64)1000);
+    if (pfrom->dBlockDownloadRate == 0)
+        pfrom->dBlockDownloadRate = dRate;
+    else
+        pfrom->dBlockDownloadRate = 0.8 * pfrom->dBlockDownloadRate + 0.2 * dRate;
+    dBestBlockDownloadRate = std::max(pfrom->dBlockDownloadRate, 0.995 * dBestBlockDownloadRate);
+}
+
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+    UpdateBlockDownloadRate(pfrom, inv.hash, ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+
+    CValidationState state;
+    if (ProcessBlock(state, pfrom, &block))
+    {
+        mapAlreadyAskedFor.erase(inv);
+        pfrom->nLastBlockTime = GetTime();
+    }
+    MarkBlockReceived(inv.hash);
+    int nDoS;
+    if (state.IsInvalid(nDoS))
+        pfrom->Misbehaving(nDoS);
+}
+
+// A block rebuilt from short IDs may have picked a wrong pool transaction;
+// that shows as a merkle root mismatch, and isn't the sender's fault
+void static ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        printf("compact block %s did not reconstruct, requesting full block\n", block.GetHash().ToString().c_str());
+        pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, block.GetHash())));
+        return;
+    }
+    printf("received compact block %s\n", block.GetHash().ToString().c_str());
+    // Most of it came from our pool, so it says nothing about the download rate
+    MarkBlockReceived(block.GetHash());
+    ProcessReceivedBlock(pfrom, block);
+}
+
+// Request blocks from the front of the download queue that no other peer is
+// fetching, up to MAX_BLOCKS_IN_TRANSIT_PER_PEER per peer. Only the first
+// BLOCK_DOWNLOAD_WINDOW queued blocks are eligible, which bounds how far
+// ahead of the lowest missing block we store blocks on disk; a peer
+// sitting on that block while others run out of work is disconnected after
+// BLOCK_STALLING_TIMEOUT, and its requests go to other peers.
+//
+// Peers get requests in proportion to their measured download rate: the
+// fastest peer downloading may have MAX_BLOCKS_IN_TRANSIT_PER_PEER in flight,
+// slower ones fewer, so the front of the queue goes to fast peers.
+unsigned int MaxBlocksInFlight(CNode* pto)
+{
+    if (pto->dBlockDownloadRate <= 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    double dBestRate = std::max(dBestBlockDownloadRate, pto->dBlockDownloadRate);
+    return std::max(1, (int)(MAX_BLOCKS_IN_TRANSIT_PER_PEER * pto->dBlockDownloadRate / dBestRate + 0.5));
+}
+
+void static FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData)
+{
+    int64 nNow = GetTime();
+    int64 nNowUsec = GetTimeMicros();
+
+    if (pto->nStallingSince && nNow - pto->nStallingSince > BLOCK_STALLING_TIMEOUT)
+    {
+        printf("peer %s is stalling block download, disconnecting\n", pto->addrName.c_str());
+        pto->fDisconnect = true;
+        return;
+    }
+    for (map<uint256, int64>::iterator it = pto->mapBlocksInFlight.begin(); it != pto->mapBlocksInFlight.end(); ++it)
+    {
+        if (nNowUsec - (*it).second > BLOCK_DOWNLOAD_TIMEOUT * 1000000)
+        {
+            printf("peer %s timed out downloading block %s, disconnecting\n", pto->addrName.c_str(), (*it).first.ToString().c_str());
+            pto->fDisconnect = true;
+            return;
+        }
+    }
+
+    if (lBlocksToDownload.empty() || pto->fInbound || pto->fClient || pto->fOneShot ||
+        !pto->fSuccessfullyConnected || fImporting || fReindex ||
+        (pto->nVersion >= NOBLKS_VERSION_START && pto->nVersion < NOBLKS_VERSION_END))
+        return;
+
+    unsigned int nMaxInFlight = MaxBlocksInFlight(pto);
+    unsigned int nWindow = 0;
+    for (list<uint256>::iterator itQueue = lBlocksToDownload.begin(); itQueue != lBlocksToDownload.end(); )
+    {
+        const uint256& hash = *itQueue;
+        if (pto->mapBlocksInFlight.size() >= nMaxInFlight)
+            break;
+
+        // Forget blocks that turned out to be invalid, or whose index is gone
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        CBlockIndex* pindex = mi == mapBlockIndex.end() ? NULL : (*mi).second;
+        if (pindex == NULL || ((pindex->nStatus & BLOCK_FAILED_MASK) && !mapBlocksInFlight.count(hash)))
+        {
+            mapBlocksToDownload.erase(hash);
+            itQueue = lBlocksToDownload.erase(itQueue);
+            continue;
+        }
+        ++itQueue;
+
+        if (++nWindow > BLOCK_DOWNLOAD_WINDOW)
+        {
+            // The whole window is in flight; whoever has the lowest block is holding it up
+            map<uint256, CNode*>::iterator it = mapBlocksInFlight.find(lBlocksToDownload.front());
+            if (it != mapBlocksInFlight.end() && (*it).second != pto && (*it).second->nStallingSince == 0)
+                (*it).second->nStallingSince = nNow;
+            break;
+        }
+        // Queued blocks are in chain order; the peer is unlikely to have the rest
+        if (pindex->nHeight > pto->nStartingHeight)
+            break;
+        if (mapBlocksInFlight.count(hash))
+            continue;
+
+        pto->mapBlocksInFlight[hash] = nNowUsec;
+        mapBlocksInFlight[hash] = pto;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        if (fDebugNet)
+            printf("sending getdata: %s\n", vGetData.back().ToString().c_str());
+    }
+}
+
 
 
 
@@ -3017,6 +3676,107 @@ bool static AlreadyHave(const CInv& inv)
 unsigned char pchMessageStart[4] = { 0xf9, 0xbe, 0xb4, 0xd9 };
 
 
+// Serialized "block" messages of the most recently requested blocks. Peers
+// fetching the same block (typically a new tip) share one copy, which is read,
+// serialized and checksummed only once.
+static const unsigned int MAX_BLOCK_MESSAGE_CACHE = 8;
+static CCriticalSection cs_lBlockMessageCache;
+static list<pair<uint256, CSerializedMessage> > lBlockMessageCache;
+
+static CSerializedMessage GetBlockMessage(CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_lBlockMessageCache);
+        for (list<pair<uint256, CSerializedMessage> >::iterator it = lBlockMessageCache.begin(); it != lBlockMessageCache.end(); it++)
+        {
+            if (it->first == hash)
+            {
+                lBlockMessageCache.splice(lBlockMessageCache.begin(), lBlockMessageCache, it);
+                return lBlockMessageCache.front().second;
+            }
+        }
+    }
+
+    CBlock block;
+    bool fRead = block.ReadFromDisk(pindex);
+    CSerializedMessage msg = MakeMessage("block", block);
+    if (fRead)
+    {
+        LOCK(cs_lBlockMessageCache);
+        lBlockMessageCache.push_front(make_pair(hash, msg));
+        if (lBlockMessageCache.size() > MAX_BLOCK_MESSAGE_CACHE)
+            lBlockMessageCache.pop_back();
+    }
+    return msg;
+}
+
+// Recently filtered blocks, with the filterable elements of each transaction
+// extracted. SPV peers rescanning the same blocks share one disk read and one
+// pass over the scripts; each filter is then matched against ready-made keys.
+struct CFilterableBlock
+{
+    CBlock block;
+    std::vector<CBloomFilterElements> vElements;
+    size_t nSize; // approximate memory use
+};
+// The cache is bounded by the approximate memory use of its blocks, since
+// a few full blocks with their elements can take tens of megabytes
+static const size_t MAX_FILTERABLE_BLOCK_CACHE_SIZE = 8 * 1000000;
+static CCriticalSection cs_lFilterableBlockCache;
+static list<pair<uint256, boost::shared_ptr<const CFilterableBlock> > > lFilterableBlockCache;
+static size_t nFilterableBlockCacheSize = 0;
+
+// Statistics for -debug output
+static int64 nFilteredBlocks = 0;
+static int64 nFilterableBlockCacheHits = 0;
+
+static boost::shared_ptr<const CFilterableBlock> GetFilterableBlock(CBlockIndex* pindex)
+{
+    typedef pair<uint256, boost::shared_ptr<const CFilterableBlock> > CacheEntry;
+    uint256 hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_lFilterableBlockCache);
+        nFilteredBlocks++;
+        for (list<CacheEntry>::iterator it = lFilterableBlockCache.begin(); it != lFilterableBlockCache.end(); it++)
+        {
+            if (it->first == hash)
+            {
+                nFilterableBlockCacheHits++;
+                lFilterableBlockCache.splice(lFilterableBlockCache.begin(), lFilterableBlockCache, it);
+                return lFilterableBlockCache.front().second;
+            }
+        }
+    }
+
+    boost::shared_ptr<CFilterableBlock> pblock(new CFilterableBlock());
+    if (!pblock->block.ReadFromDisk(pindex))
+        return boost::shared_ptr<const CFilterableBlock>();
+    pblock->vElements.reserve(pblock->block.vtx.size());
+    pblock->nSize = ::GetSerializeSize(pblock->block, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_FOREACH(const CTransaction& tx, pblock->block.vtx)
+    {
+        pblock->vElements.push_back(CBloomFilterElements(tx, tx.GetHash()));
+        const CBloomFilterElements& elements = pblock->vElements.back();
+        pblock->nSize += sizeof(elements) + elements.vOutputEnd.size() * sizeof(unsigned int);
+        BOOST_FOREACH(const vector<unsigned char>& data, elements.vOutputData)
+            pblock->nSize += sizeof(data) + data.size();
+        BOOST_FOREACH(const vector<unsigned char>& data, elements.vInputData)
+            pblock->nSize += sizeof(data) + data.size();
+    }
+    {
+        LOCK(cs_lFilterableBlockCache);
+        lFilterableBlockCache.push_front(make_pair(hash, pblock));
+        nFilterableBlockCacheSize += pblock->nSize;
+        while (nFilterableBlockCacheSize > MAX_FILTERABLE_BLOCK_CACHE_SIZE && lFilterableBlockCache.size() > 1)
+        {
+            nFilterableBlockCacheSize -= lFilterableBlockCache.back().second->nSize;
+            lFilterableBlockCache.pop_back();
+        }
+    }
+    return pblock;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -3035,20 +3795,49 @@ void static ProcessGetData(CNode* pfrom)
 
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
+                // Only the index lookup needs cs_main: entries are never freed and
+                // block data on disk doesn't change, so the read happens without it
+                CBlockIndex* pindex = NULL;
+                uint256 hashBest;
+                bool fHistorical = false;
+                {
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end() && ((*mi).second->nStatus & BLOCK_HAVE_DATA))
+                        pindex = (*mi).second;
+                    hashBest = hashBestChain;
+                    if (pindex && pindexBestHeader)
+                        fHistorical = pindexBestHeader->GetBlockTime() - pindex->GetBlockTime() > HISTORICAL_BLOCK_AGE;
+                }
+
+                // Once the upload target is nearly used up, what is left is
+                // kept for new blocks
+                if (fHistorical && CNode::OutboundTargetReached(true))
+                {
+                    printf("historical block serving limit reached, disconnecting %s\n", pfrom->addr.ToString().c_str());
+                    pfrom->fDisconnect = true;
+                    break;
+                }
+
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                if (pindex)
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                        pfrom->PushSharedMessage(GetBlockMessage(pindex));
                     else // MSG_FILTERED_BLOCK)
                     {
+                        boost::shared_ptr<const CFilterableBlock> pblock = GetFilterableBlock(pindex);
                         LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter)
+                        if (pfrom->pfilter && pblock)
                         {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                            const CBlock& block = pblock->block;
+                            int64 nStart = GetTimeMicros();
+                            CMerkleBlock merkleBlock(block.GetBlockHeader(), pblock->vElements, *pfrom->pfilter);
+                            if (fDebug)
+                                printf("filtered block %s for %s: %"PRIszu" of %"PRIszu" tx matched in %.2fms (%"PRI64d"/%"PRI64d" cache hits)\n",
+                                       inv.hash.ToString().c_str(), pfrom->addr.ToString().c_str(),
+                                       merkleBlock.vMatchedTxn.size(), block.vtx.size(), 0.001 * (GetTimeMicros() - nStart),
+                                       nFilterableBlockCacheHits, nFilteredBlocks);
                             pfrom->PushMessage("merkleblock", merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
@@ -3058,8 +3847,15 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                            {
+                                bool fKnown;
+                                {
+                                    LOCK(pfrom->cs_inventory);
+                                    fKnown = pfrom->filterInventoryKnown.contains(pair.second);
+                                }
+                                if (!fKnown)
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
                         }
                         // else
                             // no response
@@ -3072,7 +3868,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3080,30 +3876,23 @@ void static ProcessGetData(CNode* pfrom)
             }
             else if (inv.IsKnownType())
             {
-                // Send stream from relay memory
-                bool pushed = false;
+                // Send message from relay memory or the mempool; both are
+                // serialized once and shared between peers
+                CSerializedMessage msg;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
+                    map<CInv, CSerializedMessage>::iterator mi = mapRelay.find(inv);
+                    if (mi != mapRelay.end())
+                        msg = (*mi).second;
                 }
-                if (!pushed && inv.type == MSG_TX) {
+                if (!msg && inv.type == MSG_TX) {
                     LOCK(mempool.cs);
-                    if (mempool.exists(inv.hash)) {
-                        CTransaction tx = mempool.lookup(inv.hash);
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                        pushed = true;
-                    }
+                    msg = mempool.lookupMessage(inv.hash);
                 }
-                if (!pushed) {
+                if (msg)
+                    pfrom->PushSharedMessage(msg);
+                else
                     vNotFound.push_back(inv);
-                }
             }
 
             // Track requests for our stuff.
@@ -3125,6 +3914,16 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Salt for choosing the peers an address is relayed to. "addr" messages are
+// handled on several threads, so it is set with boost::call_once().
+static boost::once_flag addrSaltInitFlag = BOOST_ONCE_INIT;
+static uint256 hashAddrSalt;
+
+static void AddrSaltInit()
+{
+    hashAddrSalt = GetRandHash();
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3253,6 +4052,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     else if (strCommand == "verack")
     {
         pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+        // Ask for new blocks as compact blocks
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct", true, COMPACT_BLOCKS_ENCODING);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounce = false;
+        uint64 nEncoding = 0;
+        vRecv >> fAnnounce >> nEncoding;
+        // Other encodings, such as BIP 152's, get the usual inv
+        if (nEncoding == COMPACT_BLOCKS_ENCODING)
+            pfrom->fPreferCompactBlocks = fAnnounce;
     }
 
 
@@ -3289,11 +4103,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
+                    boost::call_once(&AddrSaltInit, addrSaltInitFlag);
                     uint64 hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
+                    uint256 hashRand = hashAddrSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     multimap<uint256, CNode*> mapMix;
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -3341,22 +4153,39 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 break;
             }
         }
+        BOOST_FOREACH(const CInv &inv, vInv)
+            pfrom->AddInventoryKnown(inv);
+
+        LOCK(cs_main);
+
+        // During initial download, blocks are fetched from all outbound peers
+        // in parallel (see FindBlocksToDownload)
+        bool fParallelDownload = IsInitialBlockDownload() && !fImporting && !fReindex;
+
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
             const CInv &inv = vInv[nInv];
 
             boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(inv);
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave) {
-                if (!fImporting && !fReindex)
+                if (fImporting || fReindex)
+                    ;
+                else if (inv.type == MSG_BLOCK && !mapBlockIndex.count(inv.hash))
+                    // Blocks are only fetched once their header connects
+                    pfrom->PushMessage("getheaders", CBlockLocator(pindexBestHeader), inv.hash);
+                else if (inv.type == MSG_BLOCK && fParallelDownload)
+                    QueueBlockDownload(inv.hash);
+                else
                     pfrom->AskFor(inv);
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+                // Out of order blocks are expected while downloading in parallel
+                if (lBlocksToDownload.empty())
+                    pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
             } else if (nInv == nLastBlock) {
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
@@ -3437,7 +4266,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3464,6 +4293,78 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers" && !fImporting && !fReindex)
+    {
+        vector<CBlockHeader> vHeaders;
+        unsigned int nCount = ReadCompactSize(vRecv);
+        if (nCount > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("headers message size = %u", nCount);
+        }
+        vHeaders.resize(nCount);
+        for (unsigned int n = 0; n < nCount; n++)
+        {
+            vRecv >> vHeaders[n];
+            ReadCompactSize(vRecv); // ignore tx count; assume it is 0
+        }
+        if (nCount == 0)
+            return true;
+
+        // The first header must connect to our tree, or we ask for the
+        // headers leading up to it
+        if (vHeaders[0].hashPrevBlock != 0 && !mapBlockIndex.count(vHeaders[0].hashPrevBlock))
+        {
+            pfrom->PushMessage("getheaders", CBlockLocator(pindexBestHeader), uint256(0));
+            return true;
+        }
+
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(const CBlockHeader& header, vHeaders)
+        {
+            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash())
+            {
+                pfrom->Misbehaving(20);
+                return error("non-continuous headers sequence");
+            }
+            CValidationState state;
+            if (!header.AcceptBlockHeader(state, &pindexLast))
+            {
+                int nDoS;
+                if (state.IsInvalid(nDoS))
+                    pfrom->Misbehaving(nDoS);
+                return error("invalid header received");
+            }
+        }
+
+        // A full reply means the peer has more
+        if (nCount == MAX_HEADERS_RESULTS)
+            pfrom->PushMessage("getheaders", CBlockLocator(pindexLast), uint256(0));
+
+        // Fetch the blocks of this stretch that we miss, if it leads to a
+        // chain with more work than ours. Earlier stretches were queued when
+        // their headers arrived.
+        if (pindexLast->nChainWork > nBestChainWork)
+        {
+            vector<CBlockIndex*> vToFetch;
+            CBlockIndex* pindex = pindexLast;
+            for (unsigned int n = 0; n < nCount && pindex && !(pindex->nStatus & BLOCK_HAVE_DATA); n++)
+            {
+                vToFetch.push_back(pindex);
+                pindex = pindex->pprev;
+            }
+            bool fParallelDownload = IsInitialBlockDownload();
+            BOOST_REVERSE_FOREACH(CBlockIndex* pindexFetch, vToFetch)
+            {
+                if (fParallelDownload)
+                    QueueBlockDownload(pindexFetch->GetBlockHash());
+                else
+                    pfrom->AskFor(CInv(MSG_BLOCK, pindexFetch->GetBlockHash()));
+            }
+        }
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3479,6 +4380,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CValidationState state;
         if (tx.AcceptToMemoryPool(state, true, true, &fMissingInputs))
         {
+            pfrom->nLastTXTime = GetTime();
             RelayTransaction(tx, inv.hash, vMsg);
             mapAlreadyAskedFor.erase(inv);
             vWorkQueue.push_back(inv.hash);
@@ -3543,21 +4445,168 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("received block %s\n", block.GetHash().ToString().c_str());
         // block.print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
+        ProcessReceivedBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hash);
         pfrom->AddInventoryKnown(inv);
+        if (fDebug)
+            printf("received compact block %s (%u txs)\n", hash.ToString().c_str(), cmpctblock.BlockTxCount());
 
+        // Treat it as a header announcement first
+        if (cmpctblock.header.hashPrevBlock != 0 && !mapBlockIndex.count(cmpctblock.header.hashPrevBlock))
+        {
+            pfrom->PushMessage("getheaders", CBlockLocator(pindexBestHeader), hash);
+            return true;
+        }
         CValidationState state;
-        if (ProcessBlock(state, pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        int nDoS;
-        if (state.IsInvalid(nDoS))
-            pfrom->Misbehaving(nDoS);
+        CBlockIndex* pindex = NULL;
+        if (!cmpctblock.header.AcceptBlockHeader(state, &pindex))
+        {
+            int nDoS;
+            if (state.IsInvalid(nDoS))
+                pfrom->Misbehaving(nDoS);
+            return error("invalid compact block header received");
+        }
+        if ((pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nChainWork <= nBestChainWork)
+            return true;
+
+        // Our pool only helps with blocks on top of our tip
+        if (pindex->pprev != pindexBest)
+        {
+            if (IsInitialBlockDownload())
+                QueueBlockDownload(hash);
+            else
+                pfrom->AskFor(inv);
+            return true;
+        }
+
+        // Only one peer at a time fetches a block's missing transactions
+        if (mapBlocksInFlight.count(hash))
+        {
+            pfrom->AskFor(inv);
+            return true;
+        }
+
+        // A block still waiting for "blocktxn" from this peer is fetched whole
+        map<CNode*, CPartialBlock>::iterator itPrev = mapPartialBlocks.find(pfrom);
+        if (itPrev != mapPartialBlocks.end())
+        {
+            CInv invPrev(MSG_BLOCK, (*itPrev).second.header.GetHash());
+            pfrom->PushMessage("getdata", vector<CInv>(1, invPrev));
+            if (pfrom->mapBlocksInFlight.count(invPrev.hash))
+                pfrom->mapBlocksInFlight[invPrev.hash] = GetTimeMicros();
+        }
+
+        CPartialBlock& partial = mapPartialBlocks[pfrom];
+        bool fInit;
+        {
+            LOCK(mempool.cs);
+            fInit = partial.Init(state, cmpctblock, mempool);
+        }
+        if (!fInit)
+        {
+            mapPartialBlocks.erase(pfrom);
+            int nDoS;
+            if (state.IsInvalid(nDoS))
+            {
+                pfrom->Misbehaving(nDoS);
+                return error("invalid compact block received");
+            }
+            MarkCompactBlockInFlight(pfrom, inv);
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
+        }
+        MarkCompactBlockInFlight(pfrom, inv);
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hash;
+        partial.GetMissing(req.vIndexes);
+        if (!req.vIndexes.empty())
+        {
+            pfrom->PushMessage("getblocktxn", req);
+            return true;
+        }
+
+        CBlock block;
+        partial.Fill(vector<CTransaction>(), block);
+        mapPartialBlocks.erase(pfrom);
+        ProcessCompactBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        map<CNode*, CPartialBlock>::iterator it = mapPartialBlocks.find(pfrom);
+        if (it == mapPartialBlocks.end() || (*it).second.header.GetHash() != resp.blockhash)
+            return true;
+
+        CBlock block;
+        bool fFilled = (*it).second.Fill(resp.vtx, block);
+        mapPartialBlocks.erase(it);
+        if (!fFilled)
+        {
+            pfrom->Misbehaving(10);
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+            return error("blocktxn with wrong number of transactions");
+        }
+        ProcessCompactBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !((*mi).second->nStatus & BLOCK_HAVE_DATA))
+            return true;
+
+        // Old blocks count against the historical block serving limit, as in getdata
+        bool fHistorical = pindexBestHeader && pindexBestHeader->GetBlockTime() - (*mi).second->GetBlockTime() > HISTORICAL_BLOCK_AGE;
+        if (fHistorical && CNode::OutboundTargetReached(true))
+        {
+            printf("historical block serving limit reached, disconnecting %s\n", pfrom->addr.ToString().c_str());
+            pfrom->fDisconnect = true;
+            return true;
+        }
+
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).second))
+            return error("getblocktxn : failed to read block %s", req.blockhash.ToString().c_str());
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        resp.vtx.reserve(req.vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("getblocktxn with out-of-bounds index %u", nIndex);
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
     }
 
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -3605,6 +4654,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "pong")
+    {
+        uint64 nonce = 0;
+        vRecv >> nonce;
+        // Only the reply to our outstanding ping counts; anything else is
+        // a stale or unsolicited pong
+        if (nonce != 0 && nonce == pfrom->nPingNonceSent)
+        {
+            int64 nPingUsecTime = GetTimeMicros() - pfrom->nPingUsecStart;
+            if (nPingUsecTime >= 0)
+            {
+                pfrom->nPingUsecTime = nPingUsecTime;
+                pfrom->nMinPingUsecTime = std::min(pfrom->nMinPingUsecTime, nPingUsecTime);
+            }
+            pfrom->nPingNonceSent = 0;
+        }
+    }
+
+
     else if (strCommand == "alert")
     {
         CAlert alert;
@@ -3698,6 +4766,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// Messages that only touch per-peer state and structures with locks of their
+// own. They are processed without cs_main, so that message handler threads
+// can serve them in parallel with validation.
+static bool IsMainLockFree(const string& strCommand)
+{
+    return strCommand == "verack" || strCommand == "addr" || strCommand == "inv" ||
+           strCommand == "getdata" || strCommand == "getaddr" || strCommand == "mempool" ||
+           strCommand == "ping" || strCommand == "pong" || strCommand == "filterload" || strCommand == "filteradd" ||
+           strCommand == "filterclear";
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -3715,7 +4794,11 @@ bool ProcessMessages(CNode* pfrom)
     bool fOk = true;
 
     if (!pfrom->vRecvGetData.empty())
+    {
+        int64 nStart = GetTimeMicros();
         ProcessGetData(pfrom);
+        pfrom->RecordMessageStats("getdata", 0, 0, GetTimeMicros() - nStart);
+    }
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
@@ -3735,6 +4818,11 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        int64 nQueueTime = GetTimeMicros() - msg.nTime;
+        pfrom->nRecvMsgCount++;
+        pfrom->nRecvQueueTimeTotal += nQueueTime;
+        pfrom->nRecvQueueTimeMax = max(pfrom->nRecvQueueTimeMax, nQueueTime);
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -3771,10 +4859,18 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64 nProcessStart = 0;
         try
         {
+            if (IsMainLockFree(strCommand))
+            {
+                nProcessStart = GetTimeMicros();
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            }
+            else
             {
                 LOCK(cs_main);
+                nProcessStart = GetTimeMicros();
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
             }
             boost::this_thread::interruption_point();
@@ -3807,6 +4903,10 @@ bool ProcessMessages(CNode* pfrom)
 
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+
+        // time spent waiting for cs_main is not counted
+        pfrom->RecordMessageStats(strCommand, 0, CMessageHeader::HEADER_SIZE + nMessageSize,
+                                  nProcessStart ? GetTimeMicros() - nProcessStart : 0);
     }
 
     // In case the connection got shut down, its receive buffer was wiped
@@ -3817,7 +4917,7 @@ bool ProcessMessages(CNode* pfrom)
 }
 
 
-bool SendMessages(CNode* pto, bool fSendTrickle)
+bool SendMessages(CNode* pto)
 {
     TRY_LOCK(cs_main, lockMain);
     if (lockMain) {
@@ -3825,20 +4925,42 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (pto->nVersion == 0)
             return true;
 
-        // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
-        // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
-            uint64 nonce = 0;
-            if (pto->nVersion > BIP0031_VERSION)
+        // Transaction invs and addresses go out in batches, on a timer per
+        // peer with exponentially distributed gaps. This hides which peer a
+        // transaction came from and keeps relay latency predictable.
+        int64 nNow = GetTimeMicros();
+        bool fSendTrickle = false;
+        if (pto->nNextInvSend < nNow)
+        {
+            fSendTrickle = true;
+            pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? nTrickleInbound : nTrickleOutbound);
+        }
+
+        // Ping peers that answer with a pong every PING_INTERVAL, to measure
+        // the round trip. Older peers get a keep-alive ping when idle.
+        if (pto->nVersion > BIP0031_VERSION) {
+            if (pto->nPingNonceSent != 0 && pto->nPingUsecStart + PING_TIMEOUT * 1000000 < GetTimeMicros()) {
+                printf("peer %s did not answer ping within %"PRI64d" seconds, disconnecting\n", pto->addrName.c_str(), PING_TIMEOUT);
+                pto->fDisconnect = true;
+                return true;
+            }
+            if (pto->nPingNonceSent == 0 && pto->nPingUsecStart + PING_INTERVAL * 1000000 < GetTimeMicros()) {
+                uint64 nonce = 0;
+                while (nonce == 0)
+                    RAND_bytes((unsigned char*)&nonce, sizeof(nonce));
+                pto->nPingNonceSent = nonce;
+                pto->nPingUsecStart = GetTimeMicros();
                 pto->PushMessage("ping", nonce);
-            else
-                pto->PushMessage("ping");
+            }
+        } else if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
+            pto->PushMessage("ping");
         }
 
-        // Start block sync
+        // Start block sync: headers first, the blocks follow once their headers are known
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            pto->PushGetBlocks(pindexBest, uint256(0));
+            QueueMissingBlocks();
+            pto->PushMessage("getheaders", CBlockLocator(pindexBestHeader), uint256(0));
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -3859,7 +4981,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_vAddrToSend);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -3879,24 +5004,20 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (fSendTrickle)
         {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_vAddrToSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+                pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + min(i + 1000, (unsigned int)vAddr.size())));
         }
 
 
@@ -3904,46 +5025,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
             vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    // always trickle our own transactions
-                    if (!fTrickleWait)
-                    {
-                        CWalletTx wtx;
-                        if (GetTransaction(inv.hash, wtx))
-                            if (wtx.fFromMe)
-                                fTrickleWait = true;
-                    }
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                if (!pto->filterInventoryKnown.contains(inv.hash))
                 {
+                    pto->filterInventoryKnown.insert(inv.hash);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000)
                     {
@@ -3952,7 +5041,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.clear();
+
+            // A batch of at most MAX_INV_TRICKLE transactions
+            if (fSendTrickle && !pto->mapInventoryTxToSend.empty())
+                SelectInventoryBatch(pto->mapInventoryTxToSend, pto->filterInventoryKnown, MAX_INV_TRICKLE, vInv);
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
@@ -3962,7 +5055,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata
         //
         vector<CInv> vGetData;
-        int64 nNow = GetTime() * 1000000;
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
             const CInv& inv = (*pto->mapAskFor.begin()).second;
@@ -3979,9 +5071,26 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        // A peer that doesn't answer "getblocktxn" in time is asked for the whole block
+        map<CNode*, CPartialBlock>::iterator itPartial = mapPartialBlocks.find(pto);
+        if (itPartial != mapPartialBlocks.end())
+        {
+            uint256 hash = (*itPartial).second.header.GetHash();
+            map<uint256, int64>::iterator itFlight = pto->mapBlocksInFlight.find(hash);
+            int64 nNowUsec = GetTimeMicros();
+            if (itFlight == pto->mapBlocksInFlight.end() || nNowUsec - (*itFlight).second > COMPACT_BLOCK_TIMEOUT * 1000000)
+            {
+                printf("peer %s did not send the transactions of compact block %s in time, requesting full block\n",
+                       pto->addr.ToString().c_str(), hash.ToString().c_str());
+                mapPartialBlocks.erase(itPartial);
+                vGetData.push_back(CInv(MSG_BLOCK, hash));
+                if (itFlight != pto->mapBlocksInFlight.end())
+                    (*itFlight).second = nNowUsec;
+            }
+        }
+        FindBlocksToDownload(pto, vGetData);
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
-
     }
     return true;
 }
@@ -4691,10 +5800,7 @@ class CMainCleanup
 public:
     CMainCleanup() {}
     ~CMainCleanup() {
-        // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
+        // block headers (the entries themselves are owned by arenaBlockIndex)
         mapBlockIndex.clear();
 
         // orphan blocks
@@ -12,6 +12,8 @@
 
 #include <list>
 
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -26,6 +28,12 @@ struct CBlockIndexWorkComparator;
 
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 static const unsigned int MAX_BLOCK_SIZE = 1000000;
+/** Blocks older than this (relative to the best header) are not served once -maxuploadtarget is reached */
+static const int64 HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+/** Seconds between pings to a peer, which measure its round trip time */
+static const int64 PING_INTERVAL = 2 * 60;
+/** Seconds a peer may take to answer a ping before it is disconnected */
+static const int64 PING_TIMEOUT = 20 * 60;
 /** The maximum size for mined blocks */
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 /** The maximum size for transactions we're willing to relay/mine */
@@ -53,6 +61,22 @@ static const int COINBASE_MATURITY = 100;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Number of blocks that can be requested from a single peer during parallel block download */
+static const unsigned int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Number of queued blocks, from the lowest one missing, that may be in flight or held as orphans */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Seconds a peer may hold up the download window before it is disconnected */
+static const int64 BLOCK_STALLING_TIMEOUT = 2;
+/** Seconds a peer may take to deliver a requested block before it is disconnected */
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 120;
+/** Seconds a peer may take to answer "getblocktxn" before the full block is requested */
+static const int64 COMPACT_BLOCK_TIMEOUT = 10;
+/** Encoding announced in "sendcmpct"; differs from BIP 152's so that neither side mistakes the other's */
+static const uint64 COMPACT_BLOCKS_ENCODING = 1000;
+/** Seconds without headers progress before the sync node is replaced */
+static const int64 SYNC_STALL_TIMEOUT = 60;
+/** Maximum number of headers in a 'headers' message (protocol limit of getheaders replies) */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -67,8 +91,15 @@ extern CScript COINBASE_FLAGS;
 
 
 
+/** Block hashes are uniformly distributed, so their low bits make a fine hash table key */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.Get64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::vector<CBlockIndex*> vBlockIndexByHeight;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
 extern uint256 hashGenesisBlock;
@@ -78,6 +109,7 @@ extern uint256 nBestChainWork;
 extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
+extern CBlockIndex* pindexBestHeader;
 extern unsigned int nTransactionsUpdated;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
@@ -135,6 +167,8 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
+/** Number of bytes allocated for CBlockIndex entries */
+size_t GetBlockIndexMemoryUsage();
 /** Unload database information */
 void UnloadBlockIndex();
 /** Verify consistency of the block and coin databases */
@@ -146,7 +180,9 @@ CBlockIndex* FindBlockByHeight(int nHeight);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
-bool SendMessages(CNode* pto, bool fSendTrickle);
+bool SendMessages(CNode* pto);
+/** Forget block download state of a node that is about to be deleted (requires cs_main) */
+void FinalizeNode(CNode* pnode);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
 /** Run the miner threads */
@@ -1310,6 +1346,14 @@ public:
     }
 
     void UpdateTime(const CBlockIndex* pindexPrev);
+
+    // Context-independent header checks
+    bool CheckBlockHeader(CValidationState &state, bool fCheckPOW=true) const;
+
+    // Check the header against its parent and add it to the block index
+    // without transaction data. The (new or existing) entry is returned in
+    // ppindex.
+    bool AcceptBlockHeader(CValidationState &state, CBlockIndex **ppindex = NULL) const;
 };
 
 class CBlock : public CBlockHeader
@@ -1498,7 +1542,7 @@ public:
     // Read a block from disk
     bool ReadFromDisk(const CBlockIndex* pindex);
 
-    // Add this block to the block index, and if necessary, switch the active block chain to this
+    // Record this block's data in the block index, and if necessary, switch the active block chain to this
     bool AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos);
 
     // Context-independent validity checks
@@ -1596,15 +1640,31 @@ enum BlockStatus {
 class CBlockIndex
 {
 public:
-    // pointer to the hash of the block, if any. memory is owned by this CBlockIndex
-    const uint256* phashBlock;
+    // The fields below are ordered by access frequency: everything walked by
+    // ancestor lookups, chain selection and version counting comes first and
+    // fits in the first 64 bytes of an entry, which CBlockIndexArena aligns to
+    // a cache line. The wide and rarely touched fields follow.
 
     // pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
+    // pointer to the index of some further predecessor of this block
+    CBlockIndex* pskip;
+
+    // pointer to the hash of the block, if any. memory is owned by mapBlockIndex
+    const uint256* phashBlock;
+
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
+    // Verification status of this block. See enum BlockStatus
+    unsigned int nStatus;
+
+    // block header (except merkle root and nonce)
+    int nVersion;
+    unsigned int nTime;
+    unsigned int nBits;
+
     // Which # file this block is stored in (blk?????.dat)
     int nFile;
 
@@ -1614,9 +1674,6 @@ public:
     // Byte offset within rev?????.dat where this block's undo data is stored
     unsigned int nUndoPos;
 
-    // (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
-    uint256 nChainWork;
-
     // Number of transactions in this block.
     // Note: in a potential headers-first mode, this number cannot be relied upon
     unsigned int nTx;
@@ -1624,14 +1681,11 @@ public:
     // (memory only) Number of transactions in the chain up to and including this block
     unsigned int nChainTx; // change to 64-bit type when necessary; won't happen before 2030
 
-    // Verification status of this block. See enum BlockStatus
-    unsigned int nStatus;
+    // (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
+    uint256 nChainWork;
 
-    // block header
-    int nVersion;
+    // cold part of the block header
     uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
     unsigned int nNonce;
 
 
@@ -1639,6 +1693,7 @@ public:
     {
         phashBlock = NULL;
         pprev = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1655,10 +1710,11 @@ public:
         nNonce         = 0;
     }
 
-    CBlockIndex(CBlockHeader& block)
+    CBlockIndex(const CBlockHeader& block)
     {
         phashBlock = NULL;
         pprev = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1716,13 +1772,19 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        uint256 bnTarget;
+        bool fNegative;
+        bool fOverflow;
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || bnTarget == 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // We need to compute 2**256 / (bnTarget+1), but we can't represent 2**256
+        // as it's too large for a uint256. However, as 2**256 is at least as large
+        // as bnTarget+1, it is equal to ((2**256 - bnTarget - 1) / (bnTarget+1)) + 1,
+        // or ~bnTarget / (bnTarget+1) + 1.
+        return (~bnTarget / (bnTarget + 1)) + 1;
     }
 
     bool IsInMainChain() const
@@ -1774,6 +1836,15 @@ public:
     static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart,
                                 unsigned int nRequired, unsigned int nToCheck);
 
+    // Build the skiplist pointer for this entry. pprev and nHeight must be set,
+    // and pprev must already have its own skiplist pointer built.
+    void BuildSkip();
+
+    // Efficiently find an ancestor of this block (or this block itself) at the
+    // given height, in O(log n) steps. Returns NULL if height is out of range.
+    CBlockIndex* GetAncestor(int height);
+    const CBlockIndex* GetAncestor(int height) const;
+
     std::string ToString() const
     {
         return strprintf("CBlockIndex(pprev=%p, pnext=%p, nHeight=%d, merkle=%s, hashBlock=%s)",
@@ -1944,7 +2015,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1978,14 +2049,19 @@ public:
         while (pindex)
         {
             vHave.push_back(pindex->GetBlockHash());
+            // Stop when we have added the genesis block
+            if (pindex->nHeight == 0)
+                break;
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            int nHeight = std::max(pindex->nHeight - nStep, 0);
+            if (pindex->IsInMainChain())
+                pindex = vBlockIndexByHeight[nHeight];
+            else
+                pindex = pindex->GetAncestor(nHeight);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
-        vHave.push_back(hashGenesisBlock);
     }
 
     int GetDistanceBack()
@@ -1995,7 +2071,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2014,7 +2090,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2030,7 +2106,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2063,6 +2139,9 @@ public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    // Serialized "tx" messages of pool transactions, built when first needed
+    // and shared by every peer the transaction is sent to
+    std::map<uint256, CSerializedMessage> mapTxMessage;
 
     bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
     bool addUnchecked(const uint256& hash, CTransaction &tx);
@@ -2087,6 +2166,10 @@ public:
     {
         return mapTx[hash];
     }
+
+    // requires LOCK(cs). Returns the "tx" message for a pool transaction, or
+    // an empty pointer if it isn't in the pool.
+    CSerializedMessage lookupMessage(const uint256& hash);
 };
 
 extern CTxMemPool mempool;
@@ -2236,6 +2319,8 @@ public:
     // Note that this will call IsRelevantAndUpdate on the filter for each transaction,
     // thus the filter will likely be modified.
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
+    // Same, from the block's header and the pre-extracted elements of its transactions
+    CMerkleBlock(const CBlockHeader& headerIn, const std::vector<CBloomFilterElements>& vElements, CBloomFilter& filter);
 
     IMPLEMENT_SERIALIZE
     (
@@ -2244,4 +2329,131 @@ public:
     )
 };
 
+
+/** A transaction sent in full within a compact block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex; // position in the block
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** Announces a block as its header, the coinbase, and salted short IDs of the
+ * other transactions, which the receiver looks up in its memory pool
+ * ("cmpctblock" message).
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    // SipHash key, derived from the header and nonce
+    uint64 nShortIDKey0, nShortIDKey1;
+
+    void FillShortIDKey();
+
+public:
+    static const unsigned int SHORTTXIDS_LENGTH = 6;
+
+    CBlockHeader header;
+    uint64 nNonce;
+    std::vector<uint64> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CBlockHeaderAndShortTxIDs() : nShortIDKey0(0), nShortIDKey1(0), nNonce(0) {}
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64 GetShortID(const uint256& txhash) const;
+
+    unsigned int BlockTxCount() const { return vShortTxIDs.size() + vPrefilledTxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockHeaderAndShortTxIDs* pthis = const_cast<CBlockHeaderAndShortTxIDs*>(this);
+        READWRITE(header);
+        READWRITE(nNonce);
+
+        // short IDs are sent as SHORTTXIDS_LENGTH little-endian bytes each
+        std::vector<unsigned char> vch;
+        if (!fRead)
+        {
+            vch.reserve(vShortTxIDs.size() * SHORTTXIDS_LENGTH);
+            BOOST_FOREACH(uint64 nShortID, vShortTxIDs)
+                for (unsigned int i = 0; i < SHORTTXIDS_LENGTH; i++)
+                    vch.push_back((nShortID >> (8 * i)) & 0xff);
+        }
+        READWRITE(vch);
+        if (fRead)
+        {
+            if (vch.size() % SHORTTXIDS_LENGTH)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs: bad short ID length");
+            pthis->vShortTxIDs.resize(vch.size() / SHORTTXIDS_LENGTH);
+            for (unsigned int n = 0; n < pthis->vShortTxIDs.size(); n++)
+            {
+                uint64 nShortID = 0;
+                for (unsigned int i = 0; i < SHORTTXIDS_LENGTH; i++)
+                    nShortID |= (uint64)vch[n * SHORTTXIDS_LENGTH + i] << (8 * i);
+                pthis->vShortTxIDs[n] = nShortID;
+            }
+        }
+
+        READWRITE(vPrefilledTxn);
+        if (fRead)
+            pthis->FillShortIDKey();
+    )
+};
+
+/** A block being rebuilt from a compact block and the memory pool */
+class CPartialBlock
+{
+public:
+    CBlockHeader header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+
+    // Place the prefilled transactions and those found in the pool. Returns
+    // false with state invalid if the announcement is malformed, or with
+    // state valid if short IDs are ambiguous and the full block is needed.
+    // Requires LOCK(pool.cs).
+    bool Init(CValidationState &state, const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool);
+
+    // Positions of the transactions still missing
+    void GetMissing(std::vector<unsigned int>& vIndexes) const;
+
+    // Complete the block with the missing transactions, in order
+    bool Fill(const std::vector<CTransaction>& vMissing, CBlock& block) const;
+};
+
+/** Asks for the transactions at the given positions of a block ("getblocktxn" message) */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    )
+};
+
+/** Reply to "getblocktxn" ("blocktxn" message) */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
 #endif
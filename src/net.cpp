@@ -12,6 +12,13 @@
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #endif
 
 #ifdef USE_UPNP
@@ -27,6 +34,8 @@ using namespace boost;
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+static void SocketEventsAdd(CNode *pnode);
+static CNode* AddOutboundNode(SOCKET hSocket, const CAddress& addrConnect, const char *pszDest);
 
 
 struct LocalServiceInfo {
@@ -49,10 +58,14 @@ uint64 nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+int nMaxConnecting = DEFAULT_MAX_CONNECTING;
+int nMessageHandlerThreads = 1;
+int nTrickleInbound = DEFAULT_TRICKLE_INBOUND;
+int nTrickleOutbound = DEFAULT_TRICKLE_OUTBOUND;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSerializedMessage> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -475,38 +488,40 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     // Connect
     SOCKET hSocket;
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, GetDefaultPort()) : ConnectSocket(addrConnect, hSocket))
-    {
-        addrman.Attempt(addrConnect);
+        return AddOutboundNode(hSocket, addrConnect, pszDest);
+    else
+        return NULL;
+}
 
-        /// debug print
-        printf("connected %s\n", pszDest ? pszDest : addrConnect.ToString().c_str());
+static CNode* AddOutboundNode(SOCKET hSocket, const CAddress& addrConnect, const char *pszDest)
+{
+    addrman.Attempt(addrConnect);
+
+    /// debug print
+    printf("connected %s\n", pszDest ? pszDest : addrConnect.ToString().c_str());
 
-        // Set to non-blocking
+    // Set to non-blocking
 #ifdef WIN32
-        u_long nOne = 1;
-        if (ioctlsocket(hSocket, FIONBIO, &nOne) == SOCKET_ERROR)
-            printf("ConnectSocket() : ioctlsocket non-blocking setting failed, error %d\n", WSAGetLastError());
+    u_long nOne = 1;
+    if (ioctlsocket(hSocket, FIONBIO, &nOne) == SOCKET_ERROR)
+        printf("ConnectSocket() : ioctlsocket non-blocking setting failed, error %d\n", WSAGetLastError());
 #else
-        if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
-            printf("ConnectSocket() : fcntl non-blocking setting failed, error %d\n", errno);
+    if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
+        printf("ConnectSocket() : fcntl non-blocking setting failed, error %d\n", errno);
 #endif
 
-        // Add node
-        CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
-        pnode->AddRef();
-
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
+    // Add node
+    CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+    pnode->AddRef();
 
-        pnode->nTimeConnected = GetTime();
-        return pnode;
-    }
-    else
     {
-        return NULL;
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+        SocketEventsAdd(pnode);
     }
+
+    pnode->nTimeConnected = GetTime();
+    return pnode;
 }
 
 void CNode::CloseSocketDisconnect()
@@ -616,12 +631,229 @@ void CNode::copyStats(CNodeStats &stats)
     X(nSendBytes);
     X(nRecvBytes);
     stats.fSyncNode = (this == pnodeSync);
+    X(nRecvMsgCount);
+    X(nRecvQueueTimeTotal);
+    X(nRecvQueueTimeMax);
+    {
+        LOCK(cs_mapMsgStats);
+        X(mapMsgStats);
+    }
+    {
+        // Don't wait for cs_main: report the rate as unmeasured instead
+        TRY_LOCK(cs_main, lockMain);
+        stats.dBlockDownloadRate = lockMain ? dBlockDownloadRate : 0;
+    }
+
+    // Copy the ping state once, as the message handler may be updating it
+    int64 nPingNonce = nPingNonceSent;
+    int64 nPingStart = nPingUsecStart;
+    int64 nPingTime = nPingUsecTime;
+    int64 nMinPingTime = nMinPingUsecTime;
+    stats.dPingTime = nPingTime * 0.000001;
+    stats.dMinPing = nMinPingTime == std::numeric_limits<int64>::max() ? 0 : nMinPingTime * 0.000001;
+    stats.dPingWait = nPingNonce != 0 ? (GetTimeMicros() - nPingStart) * 0.000001 : 0;
 }
 #undef X
 
+std::map<std::string, CMessageStats> CNode::mapMsgStatsTotal;
+CCriticalSection CNode::cs_mapMsgStatsTotal;
+
+// Peers choose the command strings they send, so only these get their own
+// statistics; anything else is counted under "*other*"
+static const char* ppszKnownCommands[] = {
+    "version", "verack", "addr", "inv", "getdata", "getblocks", "getheaders",
+    "headers", "tx", "block", "sendcmpct", "cmpctblock", "getblocktxn", "blocktxn",
+    "getaddr", "mempool", "ping", "pong", "alert", "filterload", "filteradd",
+    "filterclear", "merkleblock", "notfound",
+};
+static const set<string> setKnownCommands(ppszKnownCommands, ppszKnownCommands + ARRAYLEN(ppszKnownCommands));
+
+void CNode::RecordMessageStats(const std::string& strCommandIn, uint64 nSendBytes, uint64 nRecvBytes, int64 nProcessTime)
+{
+    static const std::string strOther("*other*");
+    const std::string& strCommand = setKnownCommands.count(strCommandIn) ? strCommandIn : strOther;
+    {
+        LOCK(cs_mapMsgStats);
+        CMessageStats& stats = mapMsgStats[strCommand];
+        stats.nSendBytes += nSendBytes;
+        stats.nRecvBytes += nRecvBytes;
+        stats.nRecvCount += (nRecvBytes > 0);
+        stats.nProcessTime += nProcessTime;
+    }
+    {
+        LOCK(cs_mapMsgStatsTotal);
+        CMessageStats& stats = mapMsgStatsTotal[strCommand];
+        stats.nSendBytes += nSendBytes;
+        stats.nRecvBytes += nRecvBytes;
+        stats.nRecvCount += (nRecvBytes > 0);
+        stats.nProcessTime += nProcessTime;
+    }
+}
+
+void CNode::GetMessageStatsTotal(std::map<std::string, CMessageStats>& mapStats)
+{
+    LOCK(cs_mapMsgStatsTotal);
+    mapStats = mapMsgStatsTotal;
+}
+
+CCriticalSection CNode::cs_totalBytesRecv;
+CCriticalSection CNode::cs_totalBytesSent;
+uint64 CNode::nTotalBytesRecv = 0;
+uint64 CNode::nTotalBytesSent = 0;
+uint64 CNode::nMaxOutboundLimit = 0;
+uint64 CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+int64 CNode::nMaxOutboundCycleStartTime = 0;
+
+void CNode::RecordBytesRecv(uint64 bytes)
+{
+    LOCK(cs_totalBytesRecv);
+    nTotalBytesRecv += bytes;
+}
+
+void CNode::RecordBytesSent(uint64 bytes)
+{
+    LOCK(cs_totalBytesSent);
+    nTotalBytesSent += bytes;
+
+    int64 nNow = GetTime();
+    if (nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME < nNow)
+    {
+        // a new cycle starts with a full budget
+        nMaxOutboundCycleStartTime = nNow;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+uint64 CNode::GetTotalBytesRecv()
+{
+    LOCK(cs_totalBytesRecv);
+    return nTotalBytesRecv;
+}
+
+uint64 CNode::GetTotalBytesSent()
+{
+    LOCK(cs_totalBytesSent);
+    return nTotalBytesSent;
+}
+
+void CNode::SetMaxOutboundTarget(uint64 nLimit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = nLimit;
+}
+
+uint64 CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64 CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+int64 CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    if (nMaxOutboundCycleStartTime == 0)
+        return MAX_UPLOAD_TIMEFRAME;
+    return std::max(nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME - GetTime(), (int64)0);
+}
+
+bool CNode::OutboundTargetReached(bool fHistoricalBlockServingLimit)
+{
+    uint64 nReserve = fHistoricalBlockServingLimit ? GetMaxOutboundTimeLeftInCycle() / 600 * MAX_BLOCK_SIZE : 0;
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+    return nMaxOutboundTotalBytesSentInCycle + nReserve >= nMaxOutboundLimit;
+}
+
+//
+// Payload buffers of received messages are recycled, so that a steady stream
+// of large messages doesn't allocate, and zero on release, a new buffer for
+// every one of them.
+//
+static const unsigned int MAX_RECV_BUFFER_POOL = 32;
+static const size_t MAX_RECV_BUFFER_POOL_SIZE = 4 * MAX_BLOCK_SIZE;
+static const size_t MAX_RECV_BUFFER_POOL_BYTES = 16 * MAX_BLOCK_SIZE;
+static CCriticalSection cs_vRecvBufferPool;
+static vector<CSerializeData> vRecvBufferPool;
+static size_t nRecvBufferPoolBytes = 0;
+
+// Give ds a buffer of nSize bytes, reusing the smallest pooled one that fits
+static void GetRecvBuffer(CDataStream &ds, unsigned int nSize)
+{
+    {
+        LOCK(cs_vRecvBufferPool);
+        int nBest = -1;
+        for (unsigned int i = 0; i < vRecvBufferPool.size(); i++)
+            if (vRecvBufferPool[i].capacity() >= nSize &&
+                (nBest < 0 || vRecvBufferPool[i].capacity() < vRecvBufferPool[nBest].capacity()))
+                nBest = i;
+        if (nBest >= 0)
+        {
+            nRecvBufferPoolBytes -= vRecvBufferPool[nBest].capacity();
+            ds.SwapData(vRecvBufferPool[nBest]);
+            vRecvBufferPool[nBest].swap(vRecvBufferPool.back());
+            vRecvBufferPool.pop_back();
+        }
+    }
+    ds.resize(nSize);
+}
+
+static void ReleaseRecvBuffer(CDataStream &ds)
+{
+    CSerializeData data;
+    ds.SwapData(data);
+    size_t nCapacity = data.capacity();
+    if (nCapacity == 0 || nCapacity > MAX_RECV_BUFFER_POOL_SIZE)
+        return;
+
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool.size() >= MAX_RECV_BUFFER_POOL || nRecvBufferPoolBytes + nCapacity > MAX_RECV_BUFFER_POOL_BYTES)
+        return;
+    data.clear();
+    vRecvBufferPool.push_back(CSerializeData());
+    vRecvBufferPool.back().swap(data);
+    nRecvBufferPoolBytes += nCapacity;
+}
+
+// requires LOCK(cs_vRecvMsg)
+char *CNode::GetRecvPayloadBuffer(unsigned int nMin, unsigned int &nSize)
+{
+    if (vRecvMsg.empty())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    if (!msg.in_data || msg.hdr.nMessageSize - msg.nDataPos < nMin)
+        return NULL;
+    nSize = msg.hdr.nMessageSize - msg.nDataPos;
+    return &msg.vRecv[msg.nDataPos];
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedPayloadBytes(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    assert(msg.in_data && nBytes <= msg.hdr.nMessageSize - msg.nDataPos);
+    msg.nDataPos += nBytes;
+    if (msg.complete()) {
+        msg.nTime = GetTimeMicros();
+        WakeMessageHandler();
+    }
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
+    bool fComplete = false;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
@@ -643,8 +875,16 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         pch += handled;
         nBytes -= handled;
+
+        if (msg.complete()) {
+            msg.nTime = GetTimeMicros();
+            fComplete = true;
+        }
     }
 
+    if (fComplete)
+        WakeMessageHandler();
+
     return true;
 }
 
@@ -675,11 +915,16 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
+    GetRecvBuffer(vRecv, hdr.nMessageSize);
 
     return nCopy;
 }
 
+CNetMessage::~CNetMessage()
+{
+    ReleaseRecvBuffer(vRecv);
+}
+
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
@@ -699,27 +944,70 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+void FinalizeMessage(CDataStream& ssMsg)
+{
+    // Set the size
+    unsigned int nSize = ssMsg.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ssMsg[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ssMsg.begin() + CMessageHeader::HEADER_SIZE, ssMsg.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ssMsg.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ssMsg[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+// Number of queued messages handed to a single sendmsg() call
+static const int SEND_IOV_MAX = 64;
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = **it;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather as many queued messages as possible into one call
+        struct iovec iov[SEND_IOV_MAX];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSerializedMessage>::iterator mi = it; mi != pnode->vSendMsg.end() && nIov < SEND_IOV_MAX; mi++, nIov++) {
+            const CSerializeData &data = **mi;
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            CNode::RecordBytesSent(nBytes);
+            // skip past the messages that were sent completely
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = (*it)->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
-                break;
             }
+            // on a partial write, try the rest right away: the socket buffer is
+            // full, so this fails with EWOULDBLOCK, which is what arms the next
+            // edge-triggered writability event
         } else {
             if (nBytes < 0) {
                 // error
@@ -742,77 +1030,546 @@ void SocketSendData(CNode *pnode)
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
+#ifdef USE_EPOLL
+//
+// Node sockets are registered edge-triggered, tagged with their CNode*, so a
+// wakeup only costs as much as the number of sockets that became ready, and
+// descriptors are not limited to FD_SETSIZE. Listening sockets and the wakeup
+// eventfd are level-triggered.
+//
+static int hEpoll = -1;
+static int hWakeupEvent = -1;
+static char chListenTag; // tags listening sockets; the wakeup eventfd is tagged NULL
+
+static void SocketEventsAdd(CNode *pnode)
+{
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == -1)
+        printf("SocketEventsAdd() : epoll_ctl failed, error %d\n", errno);
+}
+
+static bool SocketEventsInit()
+{
+    // Under cs_vNodes, so every node is registered exactly once, either here
+    // or when it is added to vNodes
+    LOCK(cs_vNodes);
+    int hEpollNew = epoll_create(256);
+    hWakeupEvent = eventfd(0, EFD_NONBLOCK);
+    if (hEpollNew == -1 || hWakeupEvent == -1)
+    {
+        printf("SocketEventsInit() : epoll setup failed, error %d\n", errno);
+        return false;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(hEpollNew, EPOLL_CTL_ADD, hWakeupEvent, &event) == -1)
+        return false;
+    event.data.ptr = &chListenTag;
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (epoll_ctl(hEpollNew, EPOLL_CTL_ADD, hListenSocket, &event) == -1)
+            return false;
+
+    hEpoll = hEpollNew;
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        SocketEventsAdd(pnode);
+    return true;
+}
+
+void WakeupSocketHandler()
+{
+    if (hWakeupEvent == -1)
+        return;
+    uint64_t nOne = 1;
+    if (write(hWakeupEvent, &nOne, sizeof(nOne)) != sizeof(nOne))
+        return; // counter saturated; a wakeup is pending anyway
+}
+#else
+static void SocketEventsAdd(CNode *pnode)
+{
+}
+
+void WakeupSocketHandler()
+{
+}
+#endif
+
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
-{
-    unsigned int nPrevNodeCount = 0;
-    loop
-    {
+static void DisconnectNodes()
+{
+    static unsigned int nPrevNodeCount = 0;
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+            {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                pnode->Cleanup();
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+            }
+        }
+
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
+            {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
+                    {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
+                        {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                            {
+                                TRY_LOCK(cs_main, lockMain);
+                                if (lockMain)
+                                {
+                                    FinalizeNode(pnode);
+                                    fDelete = true;
+                                }
+                            }
+                        }
+                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if (vNodes.size() != nPrevNodeCount)
+    {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+    }
+}
+
+static bool IsAddedNodeAddress(const CService& addr)
+{
+    LOCK(cs_setservAddNodeAddresses);
+    return setservAddNodeAddresses.count(addr) > 0;
+}
+
+static bool ReverseCompareNodeMinPingTime(const CNodeEvictionCandidate &a, const CNodeEvictionCandidate &b)
+{
+    return a.nMinPingUsecTime > b.nMinPingUsecTime;
+}
+
+static bool CompareNodeTimeConnected(const CNodeEvictionCandidate &a, const CNodeEvictionCandidate &b)
+{
+    return a.nTimeConnected < b.nTimeConnected;
+}
+
+static bool CompareNodeKeyedNetGroup(const CNodeEvictionCandidate &a, const CNodeEvictionCandidate &b)
+{
+    return a.nKeyedNetGroup < b.nKeyedNetGroup;
+}
+
+static bool CompareNodeBlockTime(const CNodeEvictionCandidate &a, const CNodeEvictionCandidate &b)
+{
+    return a.nLastBlockTime < b.nLastBlockTime;
+}
+
+static bool CompareNodeTXTime(const CNodeEvictionCandidate &a, const CNodeEvictionCandidate &b)
+{
+    return a.nLastTXTime < b.nLastTXTime;
+}
+
+// Remove up to nProtect candidates from the end of vCandidates, as sorted by
+// comparer. With pnValue, stop at candidates for which that field is zero.
+static void ProtectNodes(std::vector<CNodeEvictionCandidate>& vCandidates, bool (*comparer)(const CNodeEvictionCandidate&, const CNodeEvictionCandidate&), int64 CNodeEvictionCandidate::*pnValue, int nProtect)
+{
+    std::sort(vCandidates.begin(), vCandidates.end(), comparer);
+    int nErase = 0;
+    for (std::vector<CNodeEvictionCandidate>::reverse_iterator it = vCandidates.rbegin(); it != vCandidates.rend() && nErase < nProtect; it++)
+    {
+        if (pnValue && (*it).*pnValue == 0)
+            break;
+        nErase++;
+    }
+    vCandidates.erase(vCandidates.end() - nErase, vCandidates.end());
+}
+
+// Pick the inbound peer to drop so that a new one can connect, or return -1.
+// Peers an attacker would find hard to imitate are protected: those in a few
+// network groups chosen by a secret key, the ones with the lowest ping, the
+// ones that recently gave us new blocks and transactions, and the longest
+// connected. Of the rest, the newest peer of the best represented network
+// group goes.
+int SelectNodeToEvict(std::vector<CNodeEvictionCandidate> vCandidates)
+{
+    ProtectNodes(vCandidates, CompareNodeKeyedNetGroup, NULL, 4);
+    ProtectNodes(vCandidates, ReverseCompareNodeMinPingTime, NULL, 8);
+    ProtectNodes(vCandidates, CompareNodeTXTime, &CNodeEvictionCandidate::nLastTXTime, 4);
+    ProtectNodes(vCandidates, CompareNodeBlockTime, &CNodeEvictionCandidate::nLastBlockTime, 4);
+
+    // half of what is left, by connection time; the list is sorted oldest first
+    std::sort(vCandidates.begin(), vCandidates.end(), CompareNodeTimeConnected);
+    vCandidates.erase(vCandidates.begin(), vCandidates.begin() + vCandidates.size() / 2);
+
+    if (vCandidates.empty())
+        return -1;
+
+    // Find the network group with the most connections, preferring the one
+    // with the newest connection on ties
+    map<uint64, vector<CNodeEvictionCandidate> > mapNetGroupNodes;
+    BOOST_FOREACH(const CNodeEvictionCandidate& candidate, vCandidates)
+        mapNetGroupNodes[candidate.nKeyedNetGroup].push_back(candidate);
+    uint64 nMostConnectionsGroup = 0;
+    unsigned int nMostConnections = 0;
+    int64 nMostConnectionsTime = 0;
+    for (map<uint64, vector<CNodeEvictionCandidate> >::iterator it = mapNetGroupNodes.begin(); it != mapNetGroupNodes.end(); it++)
+    {
+        const vector<CNodeEvictionCandidate>& vGroup = (*it).second;
+        int64 nGroupTime = vGroup.back().nTimeConnected;
+        if (vGroup.size() > nMostConnections || (vGroup.size() == nMostConnections && nGroupTime > nMostConnectionsTime))
+        {
+            nMostConnectionsGroup = (*it).first;
+            nMostConnections = vGroup.size();
+            nMostConnectionsTime = nGroupTime;
+        }
+    }
+
+    // candidates are still in connection time order, so the last is the newest
+    return mapNetGroupNodes[nMostConnectionsGroup].back().nId;
+}
+
+// Disconnect an inbound peer to make room for a new one, if one deserves it
+static bool AttemptToEvictConnection()
+{
+    static uint256 hashEvictionKey = GetRandHash();
+
+    vector<CNodeEvictionCandidate> vCandidates;
+    vector<CNode*> vEvictable;
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (!pnode->fInbound || pnode->fDisconnect)
+            continue;
+        CNodeEvictionCandidate candidate;
+        candidate.nId = vEvictable.size();
+        candidate.nTimeConnected = pnode->nTimeConnected;
+        candidate.nMinPingUsecTime = pnode->nMinPingUsecTime;
+        candidate.nLastBlockTime = pnode->nLastBlockTime;
+        candidate.nLastTXTime = pnode->nLastTXTime;
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << hashEvictionKey << pnode->addr.GetGroup();
+        candidate.nKeyedNetGroup = ss.GetHash().Get64();
+        vCandidates.push_back(candidate);
+        vEvictable.push_back(pnode);
+    }
+
+    int nEvict = SelectNodeToEvict(vCandidates);
+    if (nEvict < 0)
+        return false;
+    printf("evicting %s to make room for an inbound connection\n", vEvictable[nEvict]->addr.ToString().c_str());
+    vEvictable[nEvict]->fDisconnect = true;
+    return true;
+}
+
+static void AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            printf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", nErr);
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS && !IsAddedNodeAddress(addr) && !AttemptToEvictConnection())
+    {
+        printf("connection from %s dropped (full)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+            SocketEventsAdd(pnode);
+        }
+    }
+}
+
+// Read from a node's socket; the caller must hold cs_vRecvMsg. Returns true
+// if the read filled the buffer, so more data may be waiting.
+static bool SocketRecvData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+
+    // The rest of a large payload (a block, typically) is read straight into
+    // the message. Smaller reads go through pchBuf, so that a single call can
+    // pick up several short messages.
+    unsigned int nSize = sizeof(pchBuf);
+    char *pchPayload = pnode->GetRecvPayloadBuffer(sizeof(pchBuf), nSize);
+    int nBytes = recv(pnode->hSocket, pchPayload ? pchPayload : pchBuf, nSize, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pchPayload)
+            pnode->ReceivedPayloadBytes(nBytes);
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        CNode::RecordBytesRecv(nBytes);
+        return nBytes == (int)nSize;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            printf("socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                printf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode *pnode)
+{
+    if (pnode->vSendMsg.empty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            printf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            printf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+// Readiness reported for a socket that has not been used up yet. Edge-triggered
+// events are not repeated, so these are retried until they are. Each listed node
+// holds a reference, which keeps DisconnectNodes from deleting it.
+static void SetReady(set<CNode*>& setReady, CNode *pnode)
+{
+    if (setReady.insert(pnode).second)
+        pnode->AddRef();
+}
+
+static void ClearReady(set<CNode*>& setReady, set<CNode*>::iterator& it)
+{
+    (*it)->Release();
+    setReady.erase(it++);
+}
+
+void ThreadSocketHandler()
+{
+    static const int nMaxEvents = 256;
+    struct epoll_event events[nMaxEvents];
+    set<CNode*> setRecvReady; // readable, not yet read until empty
+    set<CNode*> setSendReady; // writable, but cs_vSend was busy
+    bool fRecvMore = false;
+    int64 nLastInactivityCheck = 0;
+    loop
+    {
+        DisconnectNodes();
+
+        //
+        // Wait for events. Don't sleep while a socket is known to have more data; poll
+        // briefly while readiness is held back; otherwise wake up for inactivity checks.
+        //
+        int nTimeout = fRecvMore ? 0 : (setRecvReady.empty() && setSendReady.empty()) ? 1000 : 50;
+        int nEvents = epoll_wait(hEpoll, events, nMaxEvents, nTimeout);
+        boost::this_thread::interruption_point();
+
+        if (nEvents == -1)
+        {
+            if (errno != EINTR)
+            {
+                printf("socket epoll_wait error %d\n", errno);
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        for (int i = 0; i < nEvents; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL)
+            {
+                // EndMessage left data queued; pending sends are retried below
+                uint64_t nCount;
+                if (read(hWakeupEvent, &nCount, sizeof(nCount)) != sizeof(nCount))
+                    continue;
+            }
+            else if (ptr == &chListenTag)
+            {
+                //
+                // Accept new connections
+                //
+                BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                    if (hListenSocket != INVALID_SOCKET)
+                        AcceptConnection(hListenSocket);
+            }
+            else
+            {
+                CNode *pnode = (CNode*)ptr;
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    SetReady(setRecvReady, pnode);
+                if (events[i].events & EPOLLOUT)
+                    SetReady(setSendReady, pnode);
+            }
+        }
+
         //
-        // Disconnect nodes
+        // Send
         //
+        for (set<CNode*>::iterator it = setSendReady.begin(); it != setSendReady.end(); )
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            CNode *pnode = *it;
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (!lockSend)
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                it++;
+                continue;
+            }
+            // Anything left unsent now will raise another edge once the socket drains
+            if (pnode->hSocket != INVALID_SOCKET && !pnode->vSendMsg.empty())
+                SocketSendData(pnode);
+            ClearReady(setSendReady, it);
+        }
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+        //
+        // Receive
+        //
+        fRecvMore = false;
+        for (set<CNode*>::iterator it = setRecvReady.begin(); it != setRecvReady.end(); )
+        {
+            boost::this_thread::interruption_point();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+            CNode *pnode = *it;
+            if (pnode->hSocket == INVALID_SOCKET)
+            {
+                ClearReady(setRecvReady, it);
+                continue;
             }
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // Same flow control as with select(): drain the send queue before
+            // receiving more, and leave data in the kernel while a complete
+            // message waits for processing and the receive buffer is full.
+            bool fHold = false;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                fHold = lockSend && !pnode->vSendMsg.empty();
+            }
+            bool fMore = true;
+            if (!fHold)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && (
+                    pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                    pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
                 {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
-                        {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
-                        }
-                    }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                    fMore = SocketRecvData(pnode);
+                    fRecvMore |= fMore;
                 }
             }
+            if (fMore)
+                it++;
+            else
+                ClearReady(setRecvReady, it);
         }
-        if (vNodes.size() != nPrevNodeCount)
+
+        //
+        // Inactivity checking
+        //
+        if (GetTime() != nLastInactivityCheck)
         {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+            nLastInactivityCheck = GetTime();
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (pnode->hSocket != INVALID_SOCKET)
+                    InactivityCheck(pnode);
         }
-
+    }
+}
+#else
+void ThreadSocketHandler()
+{
+    loop
+    {
+        DisconnectNodes();
 
         //
         // Find which sockets have data to receive
@@ -900,59 +1657,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -978,38 +1684,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1027,26 +1702,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            if (pnode->vSendMsg.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1057,6 +1713,8 @@ void ThreadSocketHandler()
         MilliSleep(10);
     }
 }
+#endif
+
 
 
 
@@ -1209,25 +1867,47 @@ void ThreadDNSAddressSeed()
 
     printf("Loading addresses from DNS seeds (could take a while)\n");
 
+    // Look up all seeds (and the names they are credited to) at once, and
+    // add each seed's addresses as soon as they are in
+    set<unsigned int> setPending;
     for (unsigned int seed_idx = 0; strDNSSeed[seed_idx][0] != NULL; seed_idx++) {
         if (HaveNameProxy()) {
             AddOneShot(strDNSSeed[seed_idx][1]);
         } else {
+            resolver.Request(strDNSSeed[seed_idx][1]);
+            resolver.Request(strDNSSeed[seed_idx][0]);
+            setPending.insert(seed_idx);
+        }
+    }
+
+    while (!setPending.empty())
+    {
+        for (set<unsigned int>::iterator it = setPending.begin(); it != setPending.end(); )
+        {
+            unsigned int seed_idx = *it;
             vector<CNetAddr> vaddr;
+            vector<CNetAddr> vSource;
+            if (!resolver.Poll(strDNSSeed[seed_idx][1], vaddr) || !resolver.Poll(strDNSSeed[seed_idx][0], vSource))
+            {
+                it++;
+                continue;
+            }
+
             vector<CAddress> vAdd;
-            if (LookupHost(strDNSSeed[seed_idx][1], vaddr))
+            BOOST_FOREACH(CNetAddr& ip, vaddr)
             {
-                BOOST_FOREACH(CNetAddr& ip, vaddr)
-                {
-                    int nOneDay = 24*3600;
-                    CAddress addr = CAddress(CService(ip, GetDefaultPort()));
-                    addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
-                    vAdd.push_back(addr);
-                    found++;
-                }
+                int nOneDay = 24*3600;
+                CAddress addr = CAddress(CService(ip, GetDefaultPort()));
+                addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
+                vAdd.push_back(addr);
+                found++;
             }
-            addrman.Add(vAdd, CNetAddr(strDNSSeed[seed_idx][0], true));
+            addrman.Add(vAdd, vSource.empty() ? CNetAddr() : vSource[0]);
+            setPending.erase(it++);
         }
+        if (!setPending.empty())
+            resolver.WaitForAny(1000);
+        boost::this_thread::interruption_point();
     }
 
     printf("%d addresses found from DNS seeds\n", found);
@@ -1352,6 +2032,137 @@ void static ProcessOneShot()
     }
 }
 
+// An automatic outbound connection being made. It holds an outbound slot,
+// which moves to the node once connected.
+class CPendingConnection
+{
+public:
+    CAddress addr;
+    CSemaphoreGrant grant;
+    CConnectAttempt attempt;
+    int64 nStartTime; // milliseconds
+};
+
+static boost::shared_ptr<CPendingConnection> StartConnection(const CAddress& addrConnect)
+{
+    boost::shared_ptr<CPendingConnection> pconn;
+    if (IsLocal(addrConnect) ||
+        FindNode((CNetAddr)addrConnect) || CNode::IsBanned(addrConnect) ||
+        FindNode(addrConnect.ToStringIPPort().c_str()))
+        return pconn;
+
+    /// debug print
+    printf("trying connection %s lastseen=%.1fhrs\n",
+        addrConnect.ToString().c_str(), (double)(GetAdjustedTime() - addrConnect.nTime)/3600.0);
+
+    pconn.reset(new CPendingConnection());
+    pconn->addr = addrConnect;
+    pconn->nStartTime = GetTimeMillis();
+    if (!pconn->attempt.Start(addrConnect))
+        pconn.reset();
+    return pconn;
+}
+
+// Wait up to nTimeout milliseconds for progress on the attempts in lPending,
+// and move those that connected to vNodes. Attempts that failed or took
+// longer than nConnectTimeout are dropped.
+static void ServicePendingConnections(list<boost::shared_ptr<CPendingConnection> >& lPending, int nTimeout)
+{
+    if (lPending.empty())
+    {
+        MilliSleep(nTimeout);
+        return;
+    }
+
+    // which of the attempts, in lPending order, can make progress
+    vector<bool> vfReady;
+#ifdef WIN32
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeout / 1000;
+    timeout.tv_usec = (nTimeout % 1000) * 1000;
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    BOOST_FOREACH(const boost::shared_ptr<CPendingConnection>& pconn, lPending)
+    {
+        SOCKET hSocket = pconn->attempt.GetSocket();
+        FD_SET(hSocket, pconn->attempt.WantWrite() ? &fdsetSend : &fdsetRecv);
+        FD_SET(hSocket, &fdsetError);
+        hSocketMax = max(hSocketMax, hSocket);
+    }
+
+    int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+    if (nSelect == SOCKET_ERROR)
+    {
+        printf("socket select error %d\n", WSAGetLastError());
+        MilliSleep(nTimeout);
+        return;
+    }
+    BOOST_FOREACH(const boost::shared_ptr<CPendingConnection>& pconn, lPending)
+    {
+        SOCKET hSocket = pconn->attempt.GetSocket();
+        vfReady.push_back(FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetSend) || FD_ISSET(hSocket, &fdsetError));
+    }
+#else
+    // poll(), unlike select(), works with descriptors beyond FD_SETSIZE, which
+    // new sockets get once -maxconnections is above it
+    vector<struct pollfd> vpollfd(lPending.size());
+    unsigned int i = 0;
+    BOOST_FOREACH(const boost::shared_ptr<CPendingConnection>& pconn, lPending)
+    {
+        vpollfd[i].fd = pconn->attempt.GetSocket();
+        vpollfd[i].events = pconn->attempt.WantWrite() ? POLLOUT : POLLIN;
+        vpollfd[i].revents = 0;
+        i++;
+    }
+
+    int nPoll = poll(&vpollfd[0], vpollfd.size(), nTimeout);
+    boost::this_thread::interruption_point();
+    if (nPoll == SOCKET_ERROR)
+    {
+        printf("socket poll error %d\n", WSAGetLastError());
+        MilliSleep(nTimeout);
+        return;
+    }
+    for (i = 0; i < vpollfd.size(); i++)
+        vfReady.push_back(vpollfd[i].revents != 0);
+#endif
+
+    int64 nNow = GetTimeMillis();
+    unsigned int nPos = 0;
+    for (list<boost::shared_ptr<CPendingConnection> >::iterator it = lPending.begin(); it != lPending.end(); nPos++)
+    {
+        CPendingConnection& conn = **it;
+        if (vfReady[nPos])
+        {
+            if (!conn.attempt.Step())
+            {
+                if (conn.attempt.IsConnected())
+                {
+                    CNode* pnode = AddOutboundNode(conn.attempt.Release(), conn.addr, NULL);
+                    conn.grant.MoveTo(pnode->grantOutbound);
+                    pnode->fNetworkNode = true;
+                }
+                it = lPending.erase(it);
+                continue;
+            }
+        }
+        if (nNow - conn.nStartTime > nConnectTimeout)
+        {
+            printf("connection timeout %s\n", conn.addr.ToString().c_str());
+            it = lPending.erase(it);
+            continue;
+        }
+        it++;
+    }
+}
+
 void ThreadOpenConnections()
 {
     // Connect to specific addresses
@@ -1373,16 +2184,15 @@ void ThreadOpenConnections()
         }
     }
 
-    // Initiate network connections
+    // Initiate network connections. Up to nMaxConnecting attempts, TCP
+    // connect and SOCKS negotiation included, are in progress at once.
     int64 nStart = GetTime();
+    list<boost::shared_ptr<CPendingConnection> > lPending;
     loop
     {
         ProcessOneShot();
 
-        MilliSleep(500);
-
-        CSemaphoreGrant grant(*semOutbound);
-        boost::this_thread::interruption_point();
+        ServicePendingConnections(lPending, 500);
 
         // Add seed nodes if IRC isn't working
         if (addrman.size()==0 && (GetTime() - nStart > 60) && !fTestNet)
@@ -1404,12 +2214,8 @@ void ThreadOpenConnections()
             addrman.Add(vAdd, CNetAddr("127.0.0.1"));
         }
 
-        //
-        // Choose an address to connect to based on most recently seen
-        //
-        CAddress addrConnect;
-
-        // Only connect out to one peer per network group (/16 for IPv4).
+        // Only connect out to one peer per network group (/16 for IPv4),
+        // counting attempts in progress.
         // Do this here so we don't have to critsect vNodes inside mapAddresses critsect.
         int nOutbound = 0;
         set<vector<unsigned char> > setConnected;
@@ -1422,43 +2228,67 @@ void ThreadOpenConnections()
                 }
             }
         }
+        BOOST_FOREACH(const boost::shared_ptr<CPendingConnection>& pconn, lPending)
+            setConnected.insert(pconn->addr.GetGroup());
 
         int64 nANow = GetAdjustedTime();
 
-        int nTries = 0;
-        loop
+        // Start attempts for free outbound slots; a start that fails right away
+        // still counts, so a dead network doesn't make this spin
+        for (int nStarted = 0; (int)lPending.size() < nMaxConnecting && nStarted < nMaxConnecting; nStarted++)
         {
-            // use an nUnkBias between 10 (no outgoing connections) and 90 (8 outgoing connections)
-            CAddress addr = addrman.Select(10 + min(nOutbound,8)*10);
-
-            // if we selected an invalid address, restart
-            if (!addr.IsValid() || setConnected.count(addr.GetGroup()) || IsLocal(addr))
+            CSemaphoreGrant grant(*semOutbound, true);
+            if (!grant)
                 break;
+            boost::this_thread::interruption_point();
 
-            // If we didn't find an appropriate destination after trying 100 addresses fetched from addrman,
-            // stop this loop, and let the outer loop run again (which sleeps, adds seed nodes, recalculates
-            // already-connected network ranges, ...) before trying new addrman addresses.
-            nTries++;
-            if (nTries > 100)
-                break;
+            //
+            // Choose an address to connect to based on most recently seen
+            //
+            CAddress addrConnect;
+            int nTries = 0;
+            loop
+            {
+                // use an nUnkBias between 10 (no outgoing connections) and 90 (8 outgoing connections)
+                CAddress addr = addrman.Select(10 + min(nOutbound,8)*10);
 
-            if (IsLimited(addr))
-                continue;
+                // if we selected an invalid address, restart
+                if (!addr.IsValid() || setConnected.count(addr.GetGroup()) || IsLocal(addr))
+                    break;
 
-            // only consider very recently tried nodes after 30 failed attempts
-            if (nANow - addr.nLastTry < 600 && nTries < 30)
-                continue;
+                // If we didn't find an appropriate destination after trying 100 addresses fetched from addrman,
+                // stop this loop, and let the outer loop run again (which sleeps, adds seed nodes, recalculates
+                // already-connected network ranges, ...) before trying new addrman addresses.
+                nTries++;
+                if (nTries > 100)
+                    break;
 
-            // do not allow non-default ports, unless after 50 invalid addresses selected already
-            if (addr.GetPort() != GetDefaultPort() && nTries < 50)
-                continue;
+                if (IsLimited(addr))
+                    continue;
 
-            addrConnect = addr;
-            break;
-        }
+                // only consider very recently tried nodes after 30 failed attempts
+                if (nANow - addr.nLastTry < 600 && nTries < 30)
+                    continue;
 
-        if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+                // do not allow non-default ports, unless after 50 invalid addresses selected already
+                if (addr.GetPort() != GetDefaultPort() && nTries < 50)
+                    continue;
+
+                addrConnect = addr;
+                break;
+            }
+
+            if (!addrConnect.IsValid())
+                break;
+            setConnected.insert(addrConnect.GetGroup());
+
+            boost::shared_ptr<CPendingConnection> pconn = StartConnection(addrConnect);
+            if (pconn)
+            {
+                grant.MoveTo(pconn->grant);
+                lPending.push_back(pconn);
+            }
+        }
     }
 }
 
@@ -1496,6 +2326,18 @@ void ThreadOpenAddedConnections()
                 lAddresses.push_back(strAddNode);
         }
 
+        // Resolve the names in parallel; each Lookup below then waits for its own
+        if (fNameLookup)
+        {
+            BOOST_FOREACH(string& strAddNode, lAddresses)
+            {
+                int port;
+                string strHost;
+                SplitHostPort(strAddNode, port, strHost);
+                resolver.Request(strHost);
+            }
+        }
+
         list<vector<CService> > lservAddressesToAdd(0);
         BOOST_FOREACH(string& strAddNode, lAddresses)
         {
@@ -1564,13 +2406,42 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-// for now, use a very simple selection metric: the node from which we received
-// most recently
-double static NodeSyncScore(const CNode *pnode) {
-    return -pnode->nLastRecv;
+// Prefer the node expected to deliver a full headers message soonest: its
+// round trip plus the transfer at its block download rate. Unmeasured nodes
+// get pessimistic guesses, so that measured fast ones win.
+double NodeSyncScore(const CNode *pnode) {
+    int64 nMinPingUsecTime = pnode->nMinPingUsecTime;
+    double dRate = pnode->dBlockDownloadRate;
+    double dPing = nMinPingUsecTime == std::numeric_limits<int64>::max() ? 1.0 : nMinPingUsecTime * 0.000001;
+    if (dRate <= 0)
+        dRate = 50000;
+    return -(dPing + MAX_HEADERS_RESULTS * 81 / dRate);
+}
+
+// Best header height, and when the sync node last moved it
+static int nSyncHeaderHeight = -1;
+static int64 nSyncProgressTime = 0;
+
+// The sync node is stalled if our headers have made no progress for
+// SYNC_STALL_TIMEOUT while it claimed to have more
+bool SyncNodeStalled(CNode *pnode) {
+    int nHeight;
+    {
+        TRY_LOCK(cs_main, lockMain);
+        if (!lockMain)
+            return false;
+        nHeight = pindexBestHeader ? pindexBestHeader->nHeight : -1;
+    }
+    int64 nNow = GetTime();
+    if (nHeight != nSyncHeaderHeight || nSyncProgressTime == 0) {
+        nSyncHeaderHeight = nHeight;
+        nSyncProgressTime = nNow;
+        return false;
+    }
+    return nHeight < pnode->nStartingHeight && nNow - nSyncProgressTime > SYNC_STALL_TIMEOUT;
 }
 
-void static StartSync(const vector<CNode*> &vNodes) {
+void StartSync(const vector<CNode*> &vNodes) {
     CNode *pnodeNewSync = NULL;
     double dBestScore = 0;
 
@@ -1579,10 +2450,15 @@ void static StartSync(const vector<CNode*> &vNodes) {
     if (fImporting || fReindex)
         return;
 
+    // NodeSyncScore reads the download rates; try again on the next pass
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain)
+        return;
+
     // Iterate over all nodes
     BOOST_FOREACH(CNode* pnode, vNodes) {
         // check preconditions for allowing a sync
-        if (!pnode->fClient && !pnode->fOneShot &&
+        if (!pnode->fClient && !pnode->fOneShot && !pnode->fSyncStalled &&
             !pnode->fDisconnect && pnode->fSuccessfullyConnected &&
             (pnode->nStartingHeight > (nBestHeight - 144)) &&
             (pnode->nVersion < NOBLKS_VERSION_START || pnode->nVersion >= NOBLKS_VERSION_END)) {
@@ -1598,15 +2474,77 @@ void static StartSync(const vector<CNode*> &vNodes) {
     if (pnodeNewSync) {
         pnodeNewSync->fStartSync = true;
         pnodeSync = pnodeNewSync;
+        nSyncProgressTime = 0;
+    } else {
+        // every candidate has stalled once; give them another chance
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            pnode->fSyncStalled = false;
+    }
+}
+
+// Signalled when a message is ready for the message handler threads
+static boost::condition_variable condMsgProc;
+static boost::mutex mutexMsgProc;
+static bool fMsgProcWake = false;
+
+void WakeMessageHandler()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+        fMsgProcWake = true;
+    }
+    condMsgProc.notify_one();
+}
+
+int64 PoissonNextSend(int64 nNow, int nAverageIntervalMillis)
+{
+    // Exponentially distributed gaps; the 48 random bits are plenty
+    return nNow + (int64)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * nAverageIntervalMillis * -1000.0 + 0.5);
+}
+
+// Announcements that the peer already knows of are dropped. Of the rest, up
+// to nMax are chosen at random, and go out in the order they were queued:
+// that order puts parents before their children, which a peer would
+// otherwise have to hold as orphans.
+void SelectInventoryBatch(std::map<uint256, uint64>& mapToSend, CRollingBloomFilter& filterKnown, unsigned int nMax, std::vector<CInv>& vInv)
+{
+    vector<pair<uint64, uint256> > vBatch;
+    vBatch.reserve(mapToSend.size());
+    for (map<uint256, uint64>::iterator it = mapToSend.begin(); it != mapToSend.end(); )
+    {
+        if (filterKnown.contains((*it).first))
+            mapToSend.erase(it++);
+        else
+        {
+            vBatch.push_back(make_pair((*it).second, (*it).first));
+            it++;
+        }
+    }
+    if (vBatch.size() > nMax)
+    {
+        for (unsigned int i = 0; i < nMax; i++)
+            swap(vBatch[i], vBatch[i + GetRandInt(vBatch.size() - i)]);
+        vBatch.resize(nMax);
+    }
+    sort(vBatch.begin(), vBatch.end());
+
+    BOOST_FOREACH(const PAIRTYPE(uint64, uint256)& item, vBatch)
+    {
+        mapToSend.erase(item.second);
+        filterKnown.insert(item.second);
+        vInv.push_back(CInv(MSG_TX, item.second));
     }
 }
 
-void ThreadMessageHandler()
+// Several of these threads may run. Each services whichever nodes no other
+// thread is busy with; sync node selection is done by thread 0.
+void ThreadMessageHandler(int nThread)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
         bool fHaveSyncNode = false;
+        bool fMoreWork = false;
 
         vector<CNode*> vNodesCopy;
         {
@@ -1619,24 +2557,50 @@ void ThreadMessageHandler()
             }
         }
 
-        if (!fHaveSyncNode)
+        // Replace a sync node that stopped delivering headers
+        if (nThread == 0 && fHaveSyncNode)
+        {
+            LOCK(cs_vNodes);
+            if (pnodeSync && SyncNodeStalled(pnodeSync))
+            {
+                printf("sync node %s stalled, choosing another\n", pnodeSync->addrName.c_str());
+                pnodeSync->fSyncStalled = true;
+                pnodeSync = NULL;
+                fHaveSyncNode = false;
+            }
+        }
+
+        if (nThread == 0 && !fHaveSyncNode)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Start at a different node in each pass, so threads spread out
+        unsigned int nStart = vNodesCopy.empty() ? 0 : GetRand(vNodesCopy.size());
+        for (unsigned int i = 0; i < vNodesCopy.size(); i++)
         {
+            CNode* pnode = vNodesCopy[(nStart + i) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
+            // Another thread is servicing this node
+            TRY_LOCK(pnode->cs_process, lockProcess);
+            if (!lockProcess)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
+                {
                     if (!ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
+
+                    // Work left over that isn't waiting for the send buffer to drain
+                    if (pnode->nSendSize < SendBufferSize() && (!pnode->vRecvGetData.empty() ||
+                        (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())))
+                        fMoreWork = true;
+                }
+                else
+                    fMoreWork = true;
             }
             boost::this_thread::interruption_point();
 
@@ -1644,7 +2608,7 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                    SendMessages(pnode);
             }
             boost::this_thread::interruption_point();
         }
@@ -1655,7 +2619,11 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        MilliSleep(100);
+        // Sleep until a new message arrives, but wake up regularly for SendMessages
+        boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+        if (!fMoreWork && !fMsgProcWake)
+            condMsgProc.timed_wait(lock, boost::posix_time::milliseconds(100));
+        fMsgProcWake = false;
     }
 }
 
@@ -1828,6 +2796,15 @@ void StartNode(boost::thread_group& threadGroup)
 
     Discover();
 
+#ifdef USE_EPOLL
+    if (!SocketEventsInit())
+    {
+        uiInterface.ThreadSafeMessageBox(_("Error: Failed to set up socket event notification"), "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+        return;
+    }
+#endif
+
     //
     // Start threads
     //
@@ -1852,7 +2829,9 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand",
+                                              boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, 10000));
@@ -1869,6 +2848,7 @@ bool StopNode()
             semOutbound->post();
     MilliSleep(50);
     DumpAddresses();
+    resolver.Stop(false);
 
     return true;
 }
@@ -1889,6 +2869,12 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     printf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+        if (hWakeupEvent != -1)
+            close(hWakeupEvent);
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -1927,6 +2913,17 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash)
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
 {
     CInv inv(MSG_TX, hash);
+
+    // Share the mempool's message if the transaction is in the pool, so
+    // relay memory doesn't hold a second copy
+    CSerializedMessage msg;
+    {
+        LOCK(mempool.cs);
+        msg = mempool.lookupMessage(hash);
+    }
+    if (!msg)
+        msg = MakeMessage("tx", ss);
+
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
@@ -1936,10 +2933,11 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, msg));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
+    // The transaction is parsed for filtering once, for all peers with a filter
+    auto_ptr<CBloomFilterElements> pelements;
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
@@ -1948,7 +2946,9 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         LOCK(pnode->cs_filter);
         if (pnode->pfilter)
         {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx, hash))
+            if (!pelements.get())
+                pelements.reset(new CBloomFilterElements(tx, hash));
+            if (pnode->pfilter->IsRelevantAndUpdate(*pelements))
                 pnode->PushInventory(inv);
         } else
             pnode->PushInventory(inv);
@@ -5,16 +5,17 @@
 #ifndef BITCOIN_NET_H
 #define BITCOIN_NET_H
 
+#include <algorithm>
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
 #include <arpa/inet.h>
 #endif
 
-#include "mruset.h"
 #include "limitedmap.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -31,6 +32,28 @@ extern int nBestHeight;
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
+/** Default for -maxconnecting, the number of outbound connection attempts in progress at once */
+static const int DEFAULT_MAX_CONNECTING = 8;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGEHANDLER_THREADS = 16;
+/** Average delay between transaction inv batches sent to inbound peers, in milliseconds */
+static const int DEFAULT_TRICKLE_INBOUND = 5000;
+/** Average delay between transaction inv batches sent to outbound peers, in milliseconds */
+static const int DEFAULT_TRICKLE_OUTBOUND = 2000;
+/** Maximum number of transaction invs in one batch */
+static const unsigned int MAX_INV_TRICKLE = 1000;
+/** Number of recent invs remembered per peer, and the false positive rate for
+ *  older ones; the filter takes 2 * 36KB (MAX_BLOOM_FILTER_SIZE) at these values */
+static const unsigned int INVENTORY_KNOWN_SIZE = 5000;
+static const double INVENTORY_KNOWN_FPRATE = 0.000001;
+/** Length of the -maxuploadtarget accounting cycle, in seconds */
+static const int64 MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+
+/** Time of the next event of a Poisson process with the given average interval */
+int64 PoissonNextSend(int64 nNow, int nAverageIntervalMillis);
+/** Move the next batch of transaction invs from mapToSend to vInv */
+void SelectInventoryBatch(std::map<uint256, uint64>& mapToSend, CRollingBloomFilter& filterKnown, unsigned int nMax, std::vector<CInv>& vInv);
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
@@ -44,6 +67,26 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+void WakeupSocketHandler();
+void WakeMessageHandler();
+
+/** A complete serialized message, header included. It is never modified once
+ *  built, so the same message can be queued to any number of peers. */
+typedef boost::shared_ptr<const CSerializeData> CSerializedMessage;
+
+// Fill in the size and checksum fields of a serialized message
+void FinalizeMessage(CDataStream& ssMsg);
+
+template<typename T>
+CSerializedMessage MakeMessage(const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << payload;
+    FinalizeMessage(ss);
+    CSerializeData *pdata = new CSerializeData();
+    ss.GetAndClear(*pdata);
+    return CSerializedMessage(pdata);
+}
 
 enum
 {
@@ -75,10 +118,14 @@ extern uint64 nLocalServices;
 extern uint64 nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern int nMaxConnecting;
+extern int nMessageHandlerThreads;
+extern int nTrickleInbound;
+extern int nTrickleOutbound;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializedMessage> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64> mapAlreadyAskedFor;
@@ -89,6 +136,32 @@ extern CCriticalSection cs_vAddedNodes;
 
 
 
+/** Traffic and handling time of one message command */
+class CMessageStats
+{
+public:
+    uint64 nSendBytes;
+    uint64 nRecvBytes;
+    uint64 nRecvCount;
+    int64 nProcessTime; // microseconds spent handling received messages
+
+    CMessageStats() : nSendBytes(0), nRecvBytes(0), nRecvCount(0), nProcessTime(0) {}
+};
+
+/** What inbound peer eviction looks at, see SelectNodeToEvict */
+class CNodeEvictionCandidate
+{
+public:
+    int nId; // returned by SelectNodeToEvict
+    int64 nTimeConnected;
+    int64 nMinPingUsecTime;
+    int64 nLastBlockTime;
+    int64 nLastTXTime;
+    uint64 nKeyedNetGroup;
+};
+
+int SelectNodeToEvict(std::vector<CNodeEvictionCandidate> vCandidates);
+
 class CNodeStats
 {
 public:
@@ -105,6 +178,14 @@ public:
     uint64 nSendBytes;
     uint64 nRecvBytes;
     bool fSyncNode;
+    uint64 nRecvMsgCount;
+    int64 nRecvQueueTimeTotal;
+    int64 nRecvQueueTimeMax;
+    std::map<std::string, CMessageStats> mapMsgStats;
+    double dPingTime; // seconds, 0 until measured
+    double dMinPing;
+    double dPingWait; // seconds the outstanding ping has been waiting, or 0
+    double dBlockDownloadRate;
 };
 
 
@@ -121,13 +202,19 @@ public:
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
 
+    int64 nTime;                    // time (in microseconds) the message was completed
+
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        nTime = 0;
     }
 
+    // hands the payload buffer back to the pool it came from
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -160,19 +247,51 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64 nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // held by the message handler thread servicing this node, so that its
+    // messages are processed in order by one thread at a time
+    CCriticalSection cs_process;
     uint64 nRecvBytes;
     int nRecvVersion;
 
+    // Time received messages spent queued before processing, in microseconds
+    uint64 nRecvMsgCount;
+    int64 nRecvQueueTimeTotal;
+    int64 nRecvQueueTimeMax;
+
+    // Per command traffic and handling time, see RecordMessageStats
+    std::map<std::string, CMessageStats> mapMsgStats;
+    CCriticalSection cs_mapMsgStats;
+
     int64 nLastSend;
     int64 nLastRecv;
     int64 nLastSendEmpty;
     int64 nTimeConnected;
+
+    // Last time the peer sent us a block or transaction we didn't have yet
+    int64 nLastBlockTime;
+    int64 nLastTXTime;
+
+    // Ping round trips, in microseconds. nPingNonceSent is zero while no
+    // ping is outstanding.
+    uint64 nPingNonceSent;
+    int64 nPingUsecStart;
+    int64 nPingUsecTime;
+    int64 nMinPingUsecTime;
+
+    // Block download rate in bytes per second, a moving average over the
+    // blocks we requested; 0 until measured (protected by cs_main)
+    double dBlockDownloadRate;
+    int64 nLastBlockRecvUsec;
+
+    // Stopped making progress as the sync node; not chosen again
+    bool fSyncStalled;
+
     CAddress addr;
     std::string addrName;
     CService addrLocal;
@@ -189,6 +308,8 @@ public:
     // b) the peer may tell us in their version message that we should not relay tx invs
     //    until they have initialized their bloom filter.
     bool fRelayTxes;
+    // Peer asked for new blocks as "cmpctblock" in our encoding
+    bool fPreferCompactBlocks;
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
@@ -201,6 +322,17 @@ protected:
     static CCriticalSection cs_setBanned;
     int nMisbehavior;
 
+    // Traffic over all connections, and the -maxuploadtarget budget
+    static CCriticalSection cs_totalBytesRecv;
+    static CCriticalSection cs_totalBytesSent;
+    static uint64 nTotalBytesRecv;
+    static uint64 nTotalBytesSent;
+    static uint64 nMaxOutboundLimit;
+    static uint64 nMaxOutboundTotalBytesSentInCycle;
+    static int64 nMaxOutboundCycleStartTime;
+    static std::map<std::string, CMessageStats> mapMsgStatsTotal;
+    static CCriticalSection cs_mapMsgStatsTotal;
+
 public:
     uint256 hashContinue;
     CBlockIndex* pindexLastGetBlocksBegin;
@@ -208,19 +340,28 @@ public:
     int nStartingHeight;
     bool fStartSync;
 
+    // parallel block download (protected by cs_main); request times in microseconds
+    std::map<uint256, int64> mapBlocksInFlight;
+    int64 nStallingSince;
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend; // protects vAddrToSend and setAddrKnown
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown; // keyed on inv.hash only
     std::vector<CInv> vInventoryToSend;
+    std::map<uint256, uint64> mapInventoryTxToSend; // sent in batches, see nNextInvSend; value is the queueing order
+    uint64 nInventoryTxQueued;
     CCriticalSection cs_inventory;
+    int64 nNextInvSend; // microseconds
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, MIN_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, MIN_PROTO_VERSION),
+        filterInventoryKnown(INVENTORY_KNOWN_SIZE, INVENTORY_KNOWN_FPRATE, GetRand(0xFFFFFFFF))
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -229,8 +370,20 @@ public:
         nLastRecv = 0;
         nSendBytes = 0;
         nRecvBytes = 0;
+        nRecvMsgCount = 0;
+        nRecvQueueTimeTotal = 0;
+        nRecvQueueTimeMax = 0;
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
+        nLastBlockTime = 0;
+        nLastTXTime = 0;
+        nPingNonceSent = 0;
+        nPingUsecStart = 0;
+        nPingUsecTime = 0;
+        nMinPingUsecTime = std::numeric_limits<int64>::max();
+        dBlockDownloadRate = 0;
+        nLastBlockRecvUsec = 0;
+        fSyncStalled = false;
         addr = addrIn;
         addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
         nVersion = 0;
@@ -249,10 +402,13 @@ public:
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        nStallingSince = 0;
+        nNextInvSend = 0;
+        nInventoryTxQueued = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         fRelayTxes = false;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        fPreferCompactBlocks = false;
         pfilter = NULL;
 
         // Be shy and don't send version until we hear
@@ -295,6 +451,16 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    // If at least nMin payload bytes of the message being received are
+    // outstanding, return where they go (and their number in nSize), so they
+    // can be read from the socket in place. Otherwise return NULL.
+    char *GetRecvPayloadBuffer(unsigned int nMin, unsigned int &nSize);
+
+    // requires LOCK(cs_vRecvMsg)
+    // Account for nBytes read into the buffer from GetRecvPayloadBuffer
+    void ReceivedPayloadBytes(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -318,6 +484,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -326,6 +493,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -335,7 +503,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -343,7 +511,11 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (filterInventoryKnown.contains(inv.hash))
+                return;
+            if (inv.type == MSG_TX)
+                mapInventoryTxToSend.insert(std::make_pair(inv.hash, nInventoryTxQueued++));
+            else
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -413,32 +585,55 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        FinalizeMessage(ssSend);
 
         if (fDebug) {
-            printf("(%d bytes)\n", nSize);
+            printf("(%d bytes)\n", (int)(ssSend.size() - CMessageHeader::HEADER_SIZE));
+        }
+
+        CSerializeData *pdata = new CSerializeData();
+        ssSend.GetAndClear(*pdata);
+        bool fPending = QueueMessage(CSerializedMessage(pdata));
+
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+
+        // the socket handler sends whatever is left
+        if (fPending)
+            WakeupSocketHandler();
+    }
+
+    // Queue a message built by MakeMessage. It is shared, not copied.
+    void PushSharedMessage(const CSerializedMessage& msg)
+    {
+        bool fPending;
+        {
+            LOCK(cs_vSend);
+            fPending = QueueMessage(msg);
         }
+        if (fPending)
+            WakeupSocketHandler();
+    }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+private:
+    // requires LOCK(cs_vSend). Returns true if the message could not be
+    // written right away.
+    bool QueueMessage(const CSerializedMessage& msg)
+    {
+        std::deque<CSerializedMessage>::iterator it = vSendMsg.insert(vSendMsg.end(), msg);
+        nSendSize += msg->size();
+
+        const char* pchCommand = (const char*)&(*msg)[CMessageHeader::MESSAGE_START_SIZE];
+        RecordMessageStats(std::string(pchCommand, std::find(pchCommand, pchCommand + CMessageHeader::COMMAND_SIZE, '\0')),
+                           msg->size(), 0, 0);
 
         // If write queue empty, attempt "optimistic write"
         if (it == vSendMsg.begin())
             SocketSendData(this);
-
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+        return !vSendMsg.empty();
     }
 
+public:
+
     void PushVersion();
 
 
@@ -626,6 +821,28 @@ public:
     static bool IsBanned(CNetAddr ip);
     bool Misbehaving(int howmuch); // 1 == a little, 100 == a lot
     void copyStats(CNodeStats &stats);
+
+    // Add to the counters of a command, for this node and in total. Sent
+    // bytes are counted when a message is queued, received ones when it is
+    // processed; both include the message header.
+    void RecordMessageStats(const std::string& strCommand, uint64 nSendBytes, uint64 nRecvBytes, int64 nProcessTime);
+
+    static void RecordBytesRecv(uint64 bytes);
+    static void RecordBytesSent(uint64 bytes);
+    static uint64 GetTotalBytesRecv();
+    static uint64 GetTotalBytesSent();
+    static void GetMessageStatsTotal(std::map<std::string, CMessageStats>& mapStats);
+
+    // Upload budget per MAX_UPLOAD_TIMEFRAME, in bytes; 0 means unlimited
+    static void SetMaxOutboundTarget(uint64 nLimit);
+    static uint64 GetMaxOutboundTarget();
+    // Bytes left in the current cycle, and the seconds until it ends
+    static uint64 GetOutboundTargetBytesLeft();
+    static int64 GetMaxOutboundTimeLeftInCycle();
+    // True if the budget is used up. With fHistoricalBlockServingLimit, true
+    // already when only enough is left to serve a new block every ten minutes
+    // until the cycle ends, which is when old blocks stop being served.
+    static bool OutboundTargetReached(bool fHistoricalBlockServingLimit = false);
 };
 
 
@@ -55,18 +55,10 @@ void SplitHostPort(std::string in, int &portOut, std::string &hostOut) {
         hostOut = in;
 }
 
-bool static LookupIntern(const char *pszName, std::vector<CNetAddr>& vIP, unsigned int nMaxSolutions, bool fAllowLookup)
-{
-    vIP.clear();
-
-    {
-        CNetAddr addr;
-        if (addr.SetSpecial(std::string(pszName))) {
-            vIP.push_back(addr);
-            return true;
-        }
-    }
+CAsyncResolver& resolver = *new CAsyncResolver();
 
+bool static LookupGetAddrInfo(const char *pszName, std::vector<CNetAddr>& vIP, bool fAllowLookup)
+{
     struct addrinfo aiHint;
     memset(&aiHint, 0, sizeof(struct addrinfo));
 
@@ -88,7 +80,7 @@ bool static LookupIntern(const char *pszName, std::vector<CNetAddr>& vIP, unsign
         return false;
 
     struct addrinfo *aiTrav = aiRes;
-    while (aiTrav != NULL && (nMaxSolutions == 0 || vIP.size() < nMaxSolutions))
+    while (aiTrav != NULL)
     {
         if (aiTrav->ai_family == AF_INET)
         {
@@ -112,6 +104,166 @@ bool static LookupIntern(const char *pszName, std::vector<CNetAddr>& vIP, unsign
     return (vIP.size() > 0);
 }
 
+bool static LookupIntern(const char *pszName, std::vector<CNetAddr>& vIP, unsigned int nMaxSolutions, bool fAllowLookup)
+{
+    vIP.clear();
+
+    {
+        CNetAddr addr;
+        if (addr.SetSpecial(std::string(pszName))) {
+            vIP.push_back(addr);
+            return true;
+        }
+    }
+
+    // Numeric addresses are parsed right here, names go through the resolver's cache
+    if (!LookupGetAddrInfo(pszName, vIP, false) && fAllowLookup)
+        resolver.Lookup(pszName, vIP);
+
+    if (nMaxSolutions > 0 && vIP.size() > nMaxSolutions)
+        vIP.resize(nMaxSolutions);
+    return (vIP.size() > 0);
+}
+
+CAsyncResolver::CAsyncResolver(int nMaxThreadsIn, int64 nCacheTimeIn)
+{
+    nThreads = 0;
+    nIdle = 0;
+    nMaxThreads = nMaxThreadsIn;
+    nCacheTime = nCacheTimeIn;
+    nNextPrune = 0;
+    fStop = false;
+}
+
+CAsyncResolver::~CAsyncResolver()
+{
+    Stop();
+}
+
+void CAsyncResolver::Request(const std::string& strName)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (fStop)
+        return;
+
+    int64 nNow = GetTime();
+    if (nNow >= nNextPrune)
+    {
+        Prune(nNow);
+        nNextPrune = nNow + DNS_NEGATIVE_CACHE_TIME;
+    }
+
+    std::map<std::string, CEntry>::iterator it = mapEntries.find(strName);
+    if (it != mapEntries.end() && (!it->second.fDone || it->second.nExpire > nNow))
+        return;
+
+    CEntry& entry = mapEntries[strName];
+    entry.fDone = false;
+    entry.vIP.clear();
+    queue.push_back(strName);
+
+    // Worker threads are started as needed, so that names are resolved in parallel
+    if ((int)queue.size() > nIdle && nThreads < nMaxThreads)
+    {
+        threads.create_thread(boost::bind(&CAsyncResolver::ThreadWorker, this));
+        nThreads++;
+    }
+    else
+        condQueue.notify_one();
+}
+
+bool CAsyncResolver::Poll(const std::string& strName, std::vector<CNetAddr>& vIP)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<std::string, CEntry>::const_iterator it = mapEntries.find(strName);
+    if (it == mapEntries.end() || !it->second.fDone)
+        return false;
+    vIP = it->second.vIP;
+    return true;
+}
+
+bool CAsyncResolver::Lookup(const std::string& strName, std::vector<CNetAddr>& vIP)
+{
+    Request(strName);
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<std::string, CEntry>::const_iterator it = mapEntries.find(strName);
+    if (it == mapEntries.end())
+        return false;
+    while (!it->second.fDone && !fStop)
+        condDone.wait(lock);
+    vIP = it->second.vIP;
+    return (vIP.size() > 0);
+}
+
+void CAsyncResolver::WaitForAny(int64 nMilliseconds)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    condDone.timed_wait(lock, boost::posix_time::milliseconds(nMilliseconds));
+}
+
+void CAsyncResolver::Stop(bool fWait)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        condQueue.notify_all();
+        condDone.notify_all();
+    }
+    if (fWait)
+        threads.join_all();
+}
+
+// Forget results that expired a while ago; the grace period lets a caller
+// that requested a name still Poll() the result after it expires
+void CAsyncResolver::Prune(int64 nNow)
+{
+    std::map<std::string, CEntry>::iterator it = mapEntries.begin();
+    while (it != mapEntries.end())
+    {
+        if (it->second.fDone && it->second.nExpire + DNS_NEGATIVE_CACHE_TIME < nNow)
+            mapEntries.erase(it++);
+        else
+            ++it;
+    }
+}
+
+bool CAsyncResolver::DoLookup(const std::string& strName, std::vector<CNetAddr>& vIP)
+{
+    return LookupGetAddrInfo(strName.c_str(), vIP, true);
+}
+
+void CAsyncResolver::ThreadWorker()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true)
+    {
+        while (queue.empty() && !fStop)
+        {
+            nIdle++;
+            condQueue.wait(lock);
+            nIdle--;
+        }
+        if (fStop)
+            return;
+
+        std::string strName = queue.front();
+        queue.pop_front();
+
+        std::vector<CNetAddr> vIP;
+        lock.unlock();
+        bool fResolved = DoLookup(strName, vIP);
+        lock.lock();
+
+        CEntry& entry = mapEntries[strName];
+        entry.fDone = true;
+        entry.nExpire = GetTime() + (fResolved ? nCacheTime : DNS_NEGATIVE_CACHE_TIME);
+        if (fResolved)
+            entry.vIP.swap(vIP);
+        condDone.notify_all();
+    }
+}
+
 bool LookupHost(const char *pszName, std::vector<CNetAddr>& vIP, unsigned int nMaxSolutions, bool fAllowLookup)
 {
     std::string strHost(pszName);
@@ -309,7 +461,9 @@ bool static Socks5(string strDest, int port, SOCKET& hSocket)
     return true;
 }
 
-bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+// Creates a non-blocking socket and starts connecting it. Returns false if the
+// connection failed right away.
+bool static StartConnect(const CService &addrConnect, SOCKET& hSocketRet)
 {
     hSocketRet = INVALID_SOCKET;
 
@@ -349,43 +503,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (WSAGetLastError() == WSAEINPROGRESS || WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINVAL)
         {
-            struct timeval timeout;
-            timeout.tv_sec  = nTimeout / 1000;
-            timeout.tv_usec = (nTimeout % 1000) * 1000;
-
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
-            if (nRet == 0)
-            {
-                printf("connection timeout\n");
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet == SOCKET_ERROR)
-            {
-                printf("select() for connection failed: %i\n",WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
-            socklen_t nRetSize = sizeof(nRet);
-#ifdef WIN32
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
-#else
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
-#endif
-            {
-                printf("getsockopt() for connection failed: %i\n",WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet != 0)
-            {
-                printf("connect() failed after select(): %s\n",strerror(nRet));
-                closesocket(hSocket);
-                return false;
-            }
+            // in progress; the socket becomes writable when done
         }
 #ifdef WIN32
         else if (WSAGetLastError() != WSAEISCONN)
@@ -399,14 +517,81 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         }
     }
 
+    hSocketRet = hSocket;
+    return true;
+}
+
+// The result of a connect started by StartConnect, once its socket is writable
+bool static ConnectResult(SOCKET hSocket)
+{
+    int nRet = 0;
+    socklen_t nRetSize = sizeof(nRet);
+#ifdef WIN32
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
+#else
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+#endif
+    {
+        printf("getsockopt() for connection failed: %i\n",WSAGetLastError());
+        return false;
+    }
+    if (nRet != 0)
+    {
+        printf("connect() failed after select(): %s\n",strerror(nRet));
+        return false;
+    }
+    return true;
+}
+
+bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+{
+    SOCKET hSocket;
+    if (!StartConnect(addrConnect, hSocket))
+        return false;
+
+#ifdef WIN32
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeout / 1000;
+    timeout.tv_usec = (nTimeout % 1000) * 1000;
+
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+#else
+    // poll(), unlike select(), works with descriptors beyond FD_SETSIZE
+    struct pollfd pfd;
+    pfd.fd = hSocket;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    int nRet = poll(&pfd, 1, nTimeout);
+#endif
+    if (nRet == 0)
+    {
+        printf("connection timeout\n");
+        closesocket(hSocket);
+        return false;
+    }
+    if (nRet == SOCKET_ERROR)
+    {
+        printf("select() for connection failed: %i\n",WSAGetLastError());
+        closesocket(hSocket);
+        return false;
+    }
+    if (!ConnectResult(hSocket))
+    {
+        closesocket(hSocket);
+        return false;
+    }
+
     // this isn't even strictly necessary
     // CNode::ConnectNode immediately turns the socket back to non-blocking
     // but we'll turn it back to blocking just in case
 #ifdef WIN32
-    fNonblock = 0;
+    u_long fNonblock = 0;
     if (ioctlsocket(hSocket, FIONBIO, &fNonblock) == SOCKET_ERROR)
 #else
-    fFlags = fcntl(hSocket, F_GETFL, 0);
+    int fFlags = fcntl(hSocket, F_GETFL, 0);
     if (fcntl(hSocket, F_SETFL, fFlags & ~O_NONBLOCK) == SOCKET_ERROR)
 #endif
     {
@@ -537,6 +722,196 @@ bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest
     return true;
 }
 
+CConnectAttempt::CConnectAttempt() : hSocket(INVALID_SOCKET), nState(STATE_FAILED), nSocksVersion(0), nSocksReply(0), nRecvNeeded(0)
+{
+}
+
+CConnectAttempt::~CConnectAttempt()
+{
+    if (hSocket != INVALID_SOCKET)
+        closesocket(hSocket);
+}
+
+bool CConnectAttempt::Start(const CService& addrDestIn)
+{
+    addrDest = addrDestIn;
+    CService addrSocket = addrDest;
+    proxyType proxy;
+    if (GetProxy(addrDest.GetNetwork(), proxy))
+    {
+        nSocksVersion = proxy.second;
+        addrSocket = proxy.first;
+        if (nSocksVersion == 4 && !addrDest.IsIPv4())
+            return error("Proxy destination is not IPv4");
+    }
+    if (!StartConnect(addrSocket, hSocket))
+        return false;
+    nState = STATE_CONNECTING;
+    return true;
+}
+
+SOCKET CConnectAttempt::Release()
+{
+    SOCKET hSocketRet = hSocket;
+    hSocket = INVALID_SOCKET;
+    return hSocketRet;
+}
+
+bool CConnectAttempt::WantWrite() const
+{
+    return nState == STATE_CONNECTING || nState == STATE_SENDING;
+}
+
+bool CConnectAttempt::Fail(const char* pszError)
+{
+    if (pszError)
+        printf("ERROR: %s\n", pszError);
+    closesocket(hSocket);
+    hSocket = INVALID_SOCKET;
+    nState = STATE_FAILED;
+    return false;
+}
+
+// Queue a request to the proxy, followed by reading a reply of nReplySize bytes
+void CConnectAttempt::Send(const std::string& str, unsigned int nReplySize)
+{
+    strSend = str;
+    vchRecv.clear();
+    nRecvNeeded = nReplySize;
+    nState = strSend.empty() ? STATE_RECEIVING : STATE_SENDING;
+}
+
+bool CConnectAttempt::Step()
+{
+    if (nState == STATE_CONNECTING)
+    {
+        if (!ConnectResult(hSocket))
+            return Fail(NULL);
+        if (nSocksVersion == 0)
+        {
+            nState = STATE_CONNECTED;
+            return false;
+        }
+        printf("SOCKS%d connecting %s\n", nSocksVersion, addrDest.ToString().c_str());
+        if (nSocksVersion == 4)
+        {
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            if (!addrDest.GetSockAddr((struct sockaddr*)&addr, &len) || addr.sin_family != AF_INET)
+                return Fail("Cannot get proxy destination address");
+            char pszSocks4IP[] = "\4\1\0\0\0\0\0\0user";
+            memcpy(pszSocks4IP + 2, &addr.sin_port, 2);
+            memcpy(pszSocks4IP + 4, &addr.sin_addr, 4);
+            Send(std::string(pszSocks4IP, sizeof(pszSocks4IP)), 8);
+        }
+        else
+            Send(std::string("\5\1\0", 3), 2);
+        return true;
+    }
+
+    if (nState == STATE_SENDING)
+    {
+        int nBytes = send(hSocket, strSend.data(), strSend.size(), MSG_NOSIGNAL);
+        if (nBytes < 0)
+        {
+            if (WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINTR)
+                return true;
+            return Fail("Error sending to proxy");
+        }
+        strSend.erase(0, nBytes);
+        if (strSend.empty())
+            nState = STATE_RECEIVING;
+        return true;
+    }
+
+    if (nState == STATE_RECEIVING)
+    {
+        char pchBuf[256];
+        int nBytes = recv(hSocket, pchBuf, std::min(nRecvNeeded - (unsigned int)vchRecv.size(), (unsigned int)sizeof(pchBuf)), 0);
+        if (nBytes < 0 && (WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINTR))
+            return true;
+        if (nBytes <= 0)
+            return Fail("Error reading proxy response");
+        vchRecv.insert(vchRecv.end(), pchBuf, pchBuf + nBytes);
+        if (vchRecv.size() < nRecvNeeded)
+            return true;
+        return ProcessSocksReply();
+    }
+
+    return false;
+}
+
+// A complete reply from the proxy is in vchRecv; the messages are those of Socks4() and Socks5()
+bool CConnectAttempt::ProcessSocksReply()
+{
+    if (nSocksVersion == 4)
+    {
+        if (vchRecv[1] != 0x5a)
+        {
+            if (vchRecv[1] != 0x5b)
+                printf("ERROR: Proxy returned error %d\n", vchRecv[1]);
+            return Fail(NULL);
+        }
+        printf("SOCKS4 connected %s\n", addrDest.ToString().c_str());
+        nState = STATE_CONNECTED;
+        return false;
+    }
+
+    switch (nSocksReply++)
+    {
+    case 0:
+    {
+        if (vchRecv[0] != 0x05 || vchRecv[1] != 0x00)
+            return Fail("Proxy failed to initialize");
+        std::string strDest = addrDest.ToStringIP();
+        int port = addrDest.GetPort();
+        std::string strSocks5("\5\1");
+        strSocks5 += '\000'; strSocks5 += '\003';
+        strSocks5 += static_cast<char>(std::min((int)strDest.size(), 255));
+        strSocks5 += strDest;
+        strSocks5 += static_cast<char>((port >> 8) & 0xFF);
+        strSocks5 += static_cast<char>((port >> 0) & 0xFF);
+        Send(strSocks5, 4);
+        return true;
+    }
+    case 1:
+        if (vchRecv[0] != 0x05)
+            return Fail("Proxy failed to accept request");
+        switch (vchRecv[1])
+        {
+            case 0x00: break;
+            case 0x01: return Fail("Proxy error: general failure");
+            case 0x02: return Fail("Proxy error: connection not allowed");
+            case 0x03: return Fail("Proxy error: network unreachable");
+            case 0x04: return Fail("Proxy error: host unreachable");
+            case 0x05: return Fail("Proxy error: connection refused");
+            case 0x06: return Fail("Proxy error: TTL expired");
+            case 0x07: return Fail("Proxy error: protocol error");
+            case 0x08: return Fail("Proxy error: address type not supported");
+            default:   return Fail("Proxy error: unknown");
+        }
+        if (vchRecv[2] != 0x00)
+            return Fail("Error: malformed proxy response");
+        // the bound address, then the port
+        switch (vchRecv[3])
+        {
+            case 0x01: nSocksReply++; Send("", 4 + 2); break;
+            case 0x04: nSocksReply++; Send("", 16 + 2); break;
+            case 0x03: Send("", 1); break;
+            default: return Fail("Error: malformed proxy response");
+        }
+        return true;
+    case 2:
+        // length of the bound domain name
+        Send("", (unsigned char)vchRecv[0] + 2);
+        return true;
+    default:
+        printf("SOCKS5 connected %s\n", addrDest.ToString().c_str());
+        nState = STATE_CONNECTED;
+        return false;
+    }
+}
+
 void CNetAddr::Init()
 {
     memset(ip, 0, sizeof(ip));
@@ -4,9 +4,15 @@
 #ifndef BITCOIN_NETBASE_H
 #define BITCOIN_NETBASE_H
 
+#include <deque>
+#include <map>
 #include <string>
 #include <vector>
 
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
 #include "serialize.h"
 #include "compat.h"
 
@@ -140,6 +146,72 @@ bool GetProxy(enum Network net, proxyType &proxyInfoOut);
 bool IsProxy(const CNetAddr &addr);
 bool SetNameProxy(CService addrProxy, int nSocksVersion = 5);
 bool HaveNameProxy();
+/** Maximum number of threads resolving names at once */
+static const int DEFAULT_RESOLVER_THREADS = 8;
+/** Seconds to keep the addresses a name resolved to */
+static const int64 DNS_CACHE_TIME = 5 * 60;
+/** Seconds to remember that a name did not resolve */
+static const int64 DNS_NEGATIVE_CACHE_TIME = 30;
+
+/** Resolves host names on a pool of worker threads, so that one slow name
+ *  doesn't hold up the others, and keeps the results for a while.
+ *  getaddrinfo() doesn't report the TTL of the records, so the results are
+ *  kept for a fixed time instead. */
+class CAsyncResolver
+{
+public:
+    CAsyncResolver(int nMaxThreadsIn = DEFAULT_RESOLVER_THREADS, int64 nCacheTimeIn = DNS_CACHE_TIME);
+    virtual ~CAsyncResolver();
+
+    /** Start looking up strName, unless that is in progress or a fresh result is cached */
+    void Request(const std::string& strName);
+    /** Get the result for strName without waiting. Returns false while the lookup
+     *  is in progress or if it was never requested; vIP is empty if the name
+     *  didn't resolve. */
+    bool Poll(const std::string& strName, std::vector<CNetAddr>& vIP);
+    /** Request strName and wait for the result */
+    bool Lookup(const std::string& strName, std::vector<CNetAddr>& vIP);
+    /** Wait until some lookup finishes, for at most nMilliseconds */
+    void WaitForAny(int64 nMilliseconds);
+    /** Stop the worker threads. With fWait, wait for the lookups they are
+     *  doing; otherwise threads blocked in getaddrinfo() exit when it returns. */
+    void Stop(bool fWait = true);
+
+protected:
+    /** Resolve strName; runs on the worker threads */
+    virtual bool DoLookup(const std::string& strName, std::vector<CNetAddr>& vIP);
+
+private:
+    struct CEntry
+    {
+        bool fDone;
+        int64 nExpire;
+        std::vector<CNetAddr> vIP;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condQueue; // signalled when a name is queued
+    boost::condition_variable condDone; // signalled when a lookup finishes
+    std::map<std::string, CEntry> mapEntries;
+    std::deque<std::string> queue;
+    boost::thread_group threads;
+    int nThreads;
+    int nIdle;
+    int nMaxThreads;
+    int64 nCacheTime;
+    int64 nNextPrune;
+    bool fStop;
+
+    void ThreadWorker();
+    void Prune(int64 nNow);
+
+    CAsyncResolver(const CAsyncResolver&);
+    CAsyncResolver& operator=(const CAsyncResolver&);
+};
+
+// Never destroyed, so that StopNode() needn't wait for lookups in progress
+extern CAsyncResolver& resolver;
+
 bool LookupHost(const char *pszName, std::vector<CNetAddr>& vIP, unsigned int nMaxSolutions = 0, bool fAllowLookup = true);
 bool LookupHostNumeric(const char *pszName, std::vector<CNetAddr>& vIP, unsigned int nMaxSolutions = 0);
 bool Lookup(const char *pszName, CService& addr, int portDefault = 0, bool fAllowLookup = true);
@@ -148,4 +220,51 @@ bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault = 0, int nTimeout = nConnectTimeout);
 
+/** An outbound connection made without blocking: the TCP connect and, when a
+ *  proxy is configured for the destination's network, the SOCKS negotiation.
+ *  After Start(), call Step() whenever the socket is ready (for writing if
+ *  WantWrite(), for reading otherwise) until it returns false. The attempt
+ *  succeeded if IsConnected(); Release() then hands over the non-blocking
+ *  socket. Otherwise, or if the attempt is abandoned, the socket is closed. */
+class CConnectAttempt
+{
+public:
+    CConnectAttempt();
+    ~CConnectAttempt();
+
+    bool Start(const CService& addrDestIn);
+    bool Step();
+    bool WantWrite() const;
+    bool IsConnected() const { return nState == STATE_CONNECTED; }
+    SOCKET GetSocket() const { return hSocket; }
+    SOCKET Release();
+
+private:
+    enum
+    {
+        STATE_FAILED,
+        STATE_CONNECTING,
+        STATE_SENDING,
+        STATE_RECEIVING,
+        STATE_CONNECTED,
+    };
+
+    SOCKET hSocket;
+    int nState;
+    CService addrDest;
+    int nSocksVersion; // 0 when connecting directly
+    int nSocksReply; // which proxy reply is being received
+    std::string strSend;
+    std::vector<char> vchRecv;
+    unsigned int nRecvNeeded;
+
+    bool Fail(const char* pszError);
+    void Send(const std::string& str, unsigned int nReplySize);
+    bool ProcessSocksReply();
+
+    // not copyable: owns the socket
+    CConnectAttempt(const CConnectAttempt&);
+    CConnectAttempt& operator=(const CConnectAttempt&);
+};
+
 #endif
@@ -5,6 +5,7 @@
 
 #include "main.h"
 #include "bitcoinrpc.h"
+#include "txdb.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -157,6 +158,8 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (only the header is known)");
     block.ReadFromDisk(pblockindex);
 
     return blockToJSON(block, pblockindex);
@@ -184,6 +187,53 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value compactdb(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "compactdb\n"
+            "Flushes the coin cache and compacts the block index and coin databases.\n"
+            "Useful once after initial block download.");
+
+    {
+        LOCK(cs_main);
+        if (!pcoinsTip->Flush())
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to flush coin cache");
+    }
+
+    // LevelDB compaction is thread-safe; don't hold up validation meanwhile
+    int64 nStart = GetTimeMillis();
+    pblocktree->Compact();
+    pcoinsdbview->Compact();
+
+    Object ret;
+    ret.push_back(Pair("time_ms", (boost::int64_t)(GetTimeMillis() - nStart)));
+    return ret;
+}
+
+Value getmemoryinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmemoryinfo\n"
+            "Returns an estimate of the memory used by the block index and caches.");
+
+    Object blockindex;
+    blockindex.push_back(Pair("entries", (boost::int64_t)mapBlockIndex.size()));
+    blockindex.push_back(Pair("entry_size", (int)sizeof(CBlockIndex)));
+    blockindex.push_back(Pair("arena_bytes", (boost::int64_t)GetBlockIndexMemoryUsage()));
+    // one bucket pointer per bucket, plus a node holding the key, value and link per entry
+    size_t nMapBytes = mapBlockIndex.bucket_count() * sizeof(void*) +
+                       mapBlockIndex.size() * (sizeof(BlockMap::value_type) + 2 * sizeof(void*));
+    blockindex.push_back(Pair("map_bytes", (boost::int64_t)nMapBytes));
+
+    Object ret;
+    ret.push_back(Pair("blockindex", blockindex));
+    ret.push_back(Pair("coincache_entries", (boost::int64_t)pcoinsTip->GetCacheSize()));
+    ret.push_back(Pair("mempool_transactions", (boost::int64_t)mempool.size()));
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
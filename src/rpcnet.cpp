@@ -19,6 +19,23 @@ Value getconnectioncount(const Array& params, bool fHelp)
     return (int)vNodes.size();
 }
 
+// Bytes sent and received, messages received and milliseconds spent handling them, by command
+static Object MessageStatsToJSON(const std::map<std::string, CMessageStats>& mapStats)
+{
+    Object ret;
+    for (std::map<std::string, CMessageStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+    {
+        const CMessageStats& stats = (*it).second;
+        Object obj;
+        obj.push_back(Pair("bytessent", (boost::int64_t)stats.nSendBytes));
+        obj.push_back(Pair("bytesrecv", (boost::int64_t)stats.nRecvBytes));
+        obj.push_back(Pair("msgrecv", (boost::int64_t)stats.nRecvCount));
+        obj.push_back(Pair("processtime", (double)stats.nProcessTime / 1000));
+        ret.push_back(Pair((*it).first, obj));
+    }
+    return ret;
+}
+
 static void CopyNodeStats(std::vector<CNodeStats>& vstats)
 {
     vstats.clear();
@@ -59,8 +76,24 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("inbound", stats.fInbound));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        if (stats.dPingTime > 0)
+            obj.push_back(Pair("pingtime", stats.dPingTime));
+        if (stats.dMinPing > 0)
+            obj.push_back(Pair("minping", stats.dMinPing));
+        if (stats.dPingWait > 0)
+            obj.push_back(Pair("pingwait", stats.dPingWait));
+        if (stats.dBlockDownloadRate > 0)
+            obj.push_back(Pair("blockrate", stats.dBlockDownloadRate));
         if (stats.fSyncNode)
             obj.push_back(Pair("syncnode", true));
+        obj.push_back(Pair("msgrecv", (boost::int64_t)stats.nRecvMsgCount));
+        if (stats.nRecvMsgCount > 0)
+        {
+            // time from receipt of a message until it was processed, in milliseconds
+            obj.push_back(Pair("queuetimeavg", (double)stats.nRecvQueueTimeTotal / stats.nRecvMsgCount / 1000));
+            obj.push_back(Pair("queuetimemax", (double)stats.nRecvQueueTimeMax / 1000));
+        }
+        obj.push_back(Pair("msgstats", MessageStatsToJSON(stats.mapMsgStats)));
 
         ret.push_back(obj);
     }
@@ -68,6 +101,35 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getnettotals(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnettotals\n"
+            "Returns information about network traffic: bytes in, bytes out,\n"
+            "the state of the upload target and traffic by message command.");
+
+    Object obj;
+    obj.push_back(Pair("totalbytesrecv", (boost::int64_t)CNode::GetTotalBytesRecv()));
+    obj.push_back(Pair("totalbytessent", (boost::int64_t)CNode::GetTotalBytesSent()));
+    obj.push_back(Pair("timemillis", (boost::int64_t)GetTimeMillis()));
+
+    Object outboundLimit;
+    int64 nTimeLeft = CNode::GetMaxOutboundTimeLeftInCycle();
+    outboundLimit.push_back(Pair("timeframe", (boost::int64_t)MAX_UPLOAD_TIMEFRAME));
+    outboundLimit.push_back(Pair("target", (boost::int64_t)CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached()));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", (boost::int64_t)CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", (boost::int64_t)nTimeLeft));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
+
+    std::map<std::string, CMessageStats> mapStats;
+    CNode::GetMessageStatsTotal(mapStats);
+    obj.push_back(Pair("msgstats", MessageStatsToJSON(mapStats)));
+    return obj;
+}
+
 Value addnode(const Array& params, bool fHelp)
 {
     string strCommand;
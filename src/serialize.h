@@ -1101,6 +1101,12 @@ public:
         vch.swap(data);
         CSerializeData().swap(vch);
     }
+
+    // Exchange the underlying buffer with data and rewind, so buffers can be recycled
+    void SwapData(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
 };
 
 
@@ -6,12 +6,29 @@
 #include <boost/foreach.hpp>
 
 #include "../checkpoints.h"
+#include "../main.h"
 #include "../util.h"
 
 using namespace std;
 
 BOOST_AUTO_TEST_SUITE(Checkpoints_tests)
 
+// Blocks 1 and 2 of the main chain
+static const char* pszBlock1 =
+    "010000006fe28c0ab6f1b372c1a6a246ae63f74f931e8365e15a089c68d6190000000000982051fd1e4ba744bbbe680e1fee14677ba1a3c3540bf7b1cdb606e857233e0e61bc6649ffff001d01e36299"
+    "0101000000010000000000000000000000000000000000000000000000000000000000000000ffffffff0704ffff001d0104ffffffff0100f2052a0100000043410496b538e853519c726a2c91e61ec11600ae1390813a627c66fb8be7947be63c52da7589379515d4e0a604f8141781e62294721166bf621e73a82cbf2342c858eeac00000000";
+static const char* pszBlock2 =
+    "010000004860eb18bf1b1620e37e9490fc8a427514416fd75159ab86688e9a8300000000d5fdcc541e25de1c7a5addedf24858b8bb665c9f36ef744ee42c316022c90f9bb0bc6649ffff001d08d2bd61"
+    "0101000000010000000000000000000000000000000000000000000000000000000000000000ffffffff0704ffff001d010bffffffff0100f2052a010000004341047211a824f55b505228e4c3d5194c1fcfaa15a456abdf37f9b9d97a4040afc073dee6c89064984f03385237d92167c13e236446b417ab79a0fcae412ae3316b77ac00000000";
+
+static CBlock BlockFromHex(const char* psz)
+{
+    CDataStream ss(ParseHex(psz), SER_NETWORK, PROTOCOL_VERSION);
+    CBlock block;
+    ss >> block;
+    return block;
+}
+
 BOOST_AUTO_TEST_CASE(sanity)
 {
     uint256 p11111 = uint256("0x0000000069e244f73d78e8fd29ba2fd2ed618bd6fa2ee92559f542fdb26e7c1d");
@@ -31,4 +48,36 @@ BOOST_AUTO_TEST_CASE(sanity)
     BOOST_CHECK(Checkpoints::GetTotalBlocksEstimate() >= 134444);
 }    
 
+BOOST_AUTO_TEST_CASE(out_of_order_block_before_checkpoint)
+{
+    CBlock block1 = BlockFromHex(pszBlock1);
+    CBlock block2 = BlockFromHex(pszBlock2);
+    BOOST_REQUIRE(block1.GetHash() == uint256("0x00000000839a8e6886ab5951d76f411475428afc90947ee320161bbf18eb6048"));
+    BOOST_REQUIRE(block2.hashPrevBlock == block1.GetHash());
+
+    // Both headers are known, but only block 2 arrives, as in parallel download
+    CValidationState state;
+    BOOST_REQUIRE(block1.AcceptBlockHeader(state));
+    BOOST_REQUIRE(block2.AcceptBlockHeader(state));
+    BOOST_REQUIRE(block2.hashPrevBlock != hashBestChain);
+
+    // The header of a later checkpoint is known too
+    uint256 hashCheckpoint("0x0000000069e244f73d78e8fd29ba2fd2ed618bd6fa2ee92559f542fdb26e7c1d");
+    CBlockIndex indexCheckpoint;
+    indexCheckpoint.phashBlock = &hashCheckpoint;
+    indexCheckpoint.nHeight = 11111;
+    indexCheckpoint.nTime = block2.nTime + 24 * 60 * 60;
+    indexCheckpoint.nBits = block2.nBits;
+    mapBlockIndex[hashCheckpoint] = &indexCheckpoint;
+    BOOST_CHECK(Checkpoints::GetLastCheckpoint() == NULL);
+
+    // Block 2 predates that checkpoint, but must not be taken for spam
+    int nDoS = 0;
+    BOOST_CHECK(ProcessBlock(state, NULL, &block2));
+    BOOST_CHECK(!state.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+
+    mapBlockIndex.erase(hashCheckpoint);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -311,4 +311,76 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     LimitOrphanTxSize(0);
 }
 
+static std::vector<CNodeEvictionCandidate> EvictionCandidates(int nCount)
+{
+    std::vector<CNodeEvictionCandidate> vCandidates;
+    for (int i = 0; i < nCount; i++)
+    {
+        CNodeEvictionCandidate candidate;
+        candidate.nId = i;
+        candidate.nTimeConnected = 1000000 + i * 100;
+        candidate.nMinPingUsecTime = 100000 + 1000 * i;
+        candidate.nLastBlockTime = 0;
+        candidate.nLastTXTime = 0;
+        candidate.nKeyedNetGroup = i;
+        vCandidates.push_back(candidate);
+    }
+    return vCandidates;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_eviction)
+{
+    // too few peers to pick one that isn't protected
+    BOOST_CHECK_EQUAL(SelectNodeToEvict(EvictionCandidates(0)), -1);
+    BOOST_CHECK_EQUAL(SelectNodeToEvict(EvictionCandidates(12)), -1);
+
+    // the newest connection of the largest network group goes; it must not
+    // be one of the fast peers or those that sent something new
+    std::vector<CNodeEvictionCandidate> vCandidates = EvictionCandidates(40);
+    for (int i = 20; i < 30; i++)
+        vCandidates[i].nKeyedNetGroup = 5;
+    BOOST_CHECK_EQUAL(SelectNodeToEvict(vCandidates), 29);
+    vCandidates[29].nMinPingUsecTime = 1;
+    vCandidates[28].nLastTXTime = 5000;
+    vCandidates[27].nLastBlockTime = 5000;
+    BOOST_CHECK_EQUAL(SelectNodeToEvict(vCandidates), 26);
+
+    // among equally sized groups, the one with the newest connection; 36-39
+    // are in the network groups protected by key
+    vCandidates = EvictionCandidates(40);
+    BOOST_CHECK_EQUAL(SelectNodeToEvict(vCandidates), 35);
+
+    // whatever the stats, the fastest peers and those that sent something
+    // new never go. Stats are made distinct by adding the index, so that
+    // ties can't blur which peers were protected.
+    for (int n = 0; n < 100; n++)
+    {
+        vCandidates = EvictionCandidates(20 + GetRandInt(100));
+        BOOST_FOREACH(CNodeEvictionCandidate& candidate, vCandidates)
+        {
+            candidate.nTimeConnected = GetRandInt(1000000) * 1000 + candidate.nId;
+            candidate.nMinPingUsecTime = GetRandInt(1000000) * 1000 + candidate.nId;
+            candidate.nLastTXTime = GetRandInt(2) ? GetRandInt(1000000) * 1000 + candidate.nId + 1 : 0;
+            candidate.nLastBlockTime = GetRandInt(4) ? 0 : GetRandInt(1000000) * 1000 + candidate.nId + 1;
+            candidate.nKeyedNetGroup = GetRandInt(10);
+        }
+        int nEvict = SelectNodeToEvict(vCandidates);
+        if (nEvict == -1)
+            continue;
+        int nFaster = 0, nLaterTX = 0, nLaterBlock = 0;
+        BOOST_FOREACH(const CNodeEvictionCandidate& candidate, vCandidates)
+        {
+            if (candidate.nMinPingUsecTime < vCandidates[nEvict].nMinPingUsecTime)
+                nFaster++;
+            if (candidate.nLastTXTime > vCandidates[nEvict].nLastTXTime)
+                nLaterTX++;
+            if (candidate.nLastBlockTime > vCandidates[nEvict].nLastBlockTime)
+                nLaterBlock++;
+        }
+        BOOST_CHECK(nFaster >= 8);
+        BOOST_CHECK(nLaterTX >= 4 || vCandidates[nEvict].nLastTXTime == 0);
+        BOOST_CHECK(nLaterBlock >= 4 || vCandidates[nEvict].nLastBlockTime == 0);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,149 @@
+#include <boost/test/unit_test.hpp>
+
+#include "addrman.h"
+#include "util.h"
+
+using namespace std;
+
+// Random routable IPv4 address, in one of nGroups /16s
+static CAddress RandomAddress(int nGroups)
+{
+    unsigned int nGroup = GetRandInt(nGroups);
+    struct in_addr ip;
+    ip.s_addr = htonl(((1 + nGroup / 250) << 24) | ((nGroup % 250) << 16) | GetRandInt(1 << 16));
+    CAddress addr(CService(ip, 8333));
+    addr.nTime = GetAdjustedTime() - GetRandInt(3 * 24 * 60 * 60);
+    return addr;
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_simple)
+{
+    CAddrMan addrman;
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+    BOOST_CHECK(!addrman.Select().IsValid());
+
+    CNetAddr source("252.2.2.2");
+    CAddress addr1(CService("250.1.1.1", 8333));
+    addr1.nTime = GetAdjustedTime();
+    BOOST_CHECK(addrman.Add(addr1, source));
+    BOOST_CHECK(!addrman.Add(addr1, source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Select(0) == addr1);
+    BOOST_CHECK(addrman.Select(100) == addr1);
+
+    // unroutable addresses are refused
+    CAddress addrLocal(CService("127.0.0.1", 8333));
+    BOOST_CHECK(!addrman.Add(addrLocal, source));
+
+    // moving to tried leaves the new table empty, and selection still works
+    addrman.Good(addr1);
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Select(100) == addr1);
+    BOOST_CHECK(addrman.Select(0) == addr1);
+
+    CAddress addr2(CService("250.2.1.1", 8333));
+    addr2.nTime = GetAdjustedTime();
+    BOOST_CHECK(addrman.Add(addr2, source));
+    BOOST_CHECK_EQUAL(addrman.size(), 2);
+    BOOST_CHECK_EQUAL(addrman.GetAddr().size(), 0U); // 23% of 2 rounds down
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrMan addrman;
+    vector<CAddress> vAddr;
+    for (int i = 0; i < 5000; i++)
+        vAddr.push_back(RandomAddress(100));
+    addrman.Add(vAddr, CNetAddr("252.2.2.2"));
+    for (int i = 0; i < 200; i++)
+        addrman.Good(vAddr[i]);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CAddrMan addrman2;
+    ss >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+
+    // same contents, and the same bytes when written again
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << addrman2;
+    CDataStream ss3(SER_DISK, CLIENT_VERSION);
+    ss3 << addrman;
+    BOOST_CHECK_EQUAL(ss2.size(), ss3.size());
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(addrman2.Select().IsValid());
+}
+
+// peers.dat written with another bucket count, holding more addresses from
+// one group and source than fit in their bucket
+BOOST_AUTO_TEST_CASE(addrman_serialize_rebucket)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    unsigned char nVersion = 0;
+    vector<unsigned char> nKey(32, 1);
+    int nNew = 200, nTried = 0, nUBuckets = 1;
+    ss << nVersion << nKey << nNew << nTried << nUBuckets;
+    CNetAddr source("252.2.2.2");
+    for (int i = 0; i < nNew; i++)
+    {
+        CAddress addr(CService(strprintf("250.1.%d.%d", i / 250, i % 250 + 1), 8333));
+        addr.nTime = GetAdjustedTime();
+        ss << CAddrInfo(addr, source);
+    }
+    int nSize = 0;
+    ss << nSize;
+
+    CAddrMan addrman;
+    ss >> addrman;
+    BOOST_CHECK(addrman.size() > 0 && addrman.size() < nNew);
+
+    // written again, the header agrees with the entries
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << addrman;
+    CAddrMan addrman2;
+    ss2 >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+    BOOST_CHECK(ss2.empty());
+}
+
+// throughput of adding to full tables, selecting, and writing peers.dat
+BOOST_AUTO_TEST_CASE(addrman_benchmark)
+{
+    static const int nAddresses = 200000;
+    CAddrMan addrman;
+    vector<CAddress> vAddr;
+    for (int i = 0; i < nAddresses; i++)
+        vAddr.push_back(RandomAddress(5000));
+
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < nAddresses; i += 10000)
+    {
+        CNetAddr source = RandomAddress(5000);
+        addrman.Add(vector<CAddress>(vAddr.begin() + i, vAddr.begin() + i + 10000), source);
+    }
+    int64 nAdd = GetTimeMicros() - nStart;
+    for (int i = 0; i < nAddresses; i += 100)
+        addrman.Good(vAddr[i]);
+    BOOST_CHECK(addrman.size() > 10000);
+
+    static const int nSelects = 20000;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nSelects; i++)
+        BOOST_CHECK(addrman.Select(10 + i % 80).IsValid());
+    int64 nSelect = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CAddrMan addrman2;
+    ss >> addrman2;
+    int64 nSerialize = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+
+    BOOST_TEST_MESSAGE(strprintf("addrman: %d addresses kept, %.2fus/add, %.2fus/select, %.1fms write+read",
+        addrman.size(), (double)nAdd / nAddresses, (double)nSelect / nSelects, nSerialize / 1000.0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
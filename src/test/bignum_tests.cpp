@@ -2,6 +2,7 @@
 #include <limits>
 
 #include "bignum.h"
+#include "main.h"
 #include "util.h"
 
 BOOST_AUTO_TEST_SUITE(bignum_tests)
@@ -175,4 +176,28 @@ BOOST_AUTO_TEST_CASE(bignum_SetCompact)
     BOOST_CHECK_EQUAL(num.GetCompact(), 0xff123456U);
 }
 
+// CBlockIndex::GetBlockWork uses native 256-bit arithmetic; it must agree with CBigNum
+BOOST_AUTO_TEST_CASE(bignum_GetBlockWork)
+{
+    unsigned int vBits[] = { 0x1d00ffff, 0x1b0404cb, 0x1a05db8b, 0x207fffff, 0x03000001, 0x01003456, 0x04923456, 0x21010000, 0 };
+    std::vector<unsigned int> v(vBits, vBits + sizeof(vBits) / sizeof(vBits[0]));
+    for (int i = 0; i < 1000; i++)
+        v.push_back(GetRandInt(0x21) << 24 | GetRandInt(0x800000));
+
+    BOOST_FOREACH(unsigned int nBits, v)
+    {
+        CBlockIndex index;
+        index.nBits = nBits;
+
+        CBigNum bnTarget;
+        bnTarget.SetCompact(nBits);
+        CBigNum bnWork = bnTarget <= 0 ? 0 : (CBigNum(1)<<256) / (bnTarget+1);
+        BOOST_CHECK_MESSAGE(index.GetBlockWork() == bnWork.getuint256(), strprintf("nBits=%08x", nBits));
+    }
+
+    CBlockIndex index;
+    index.nBits = 0x1d00ffff;
+    BOOST_CHECK(index.GetBlockWork() == 0x100010001ULL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -421,6 +421,37 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_p2pubkey_only)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(merkle_block_4_from_elements)
+{
+    // Random real block (000000000000b731f2eef9e8c63173adfb07e41bd53eb0ef0a6b720d6cb6dea4)
+    // With 7 txes
+    CBlock block;
+    CDataStream stream(ParseHex("0100000082bb869cf3a793432a66e826e05a6fc37469f8efb7421dc880670100000000007f16c5962e8bd963659c793ce370d95f093bc7e367117b3c30c1f8fdd0d9728776381b4d4c86041b554b85290701000000010000000000000000000000000000000000000000000000000000000000000000ffffffff07044c86041b0136ffffffff0100f2052a01000000434104eaafc2314def4ca98ac970241bcab022b9c1e1f4ea423a20f134c876f2c01ec0f0dd5b2e86e7168cefe0d81113c3807420ce13ad1357231a2252247d97a46a91ac000000000100000001bcad20a6a29827d1424f08989255120bf7f3e9e3cdaaa6bb31b0737fe048724300000000494830450220356e834b046cadc0f8ebb5a8a017b02de59c86305403dad52cd77b55af062ea10221009253cd6c119d4729b77c978e1e2aa19f5ea6e0e52b3f16e32fa608cd5bab753901ffffffff02008d380c010000001976a9142b4b8072ecbba129b6453c63e129e643207249ca88ac0065cd1d000000001976a9141b8dd13b994bcfc787b32aeadf58ccb3615cbd5488ac000000000100000003fdacf9b3eb077412e7a968d2e4f11b9a9dee312d666187ed77ee7d26af16cb0b000000008c493046022100ea1608e70911ca0de5af51ba57ad23b9a51db8d28f82c53563c56a05c20f5a87022100a8bdc8b4a8acc8634c6b420410150775eb7f2474f5615f7fccd65af30f310fbf01410465fdf49e29b06b9a1582287b6279014f834edc317695d125ef623c1cc3aaece245bd69fcad7508666e9c74a49dc9056d5fc14338ef38118dc4afae5fe2c585caffffffff309e1913634ecb50f3c4f83e96e70b2df071b497b8973a3e75429df397b5af83000000004948304502202bdb79c596a9ffc24e96f4386199aba386e9bc7b6071516e2b51dda942b3a1ed022100c53a857e76b724fc14d45311eac5019650d415c3abb5428f3aae16d8e69bec2301ffffffff2089e33491695080c9edc18a428f7d834db5b6d372df13ce2b1b0e0cbcb1e6c10000000049483045022100d4ce67c5896ee251c810ac1ff9ceccd328b497c8f553ab6e08431e7d40bad6b5022033119c0c2b7d792d31f1187779c7bd95aefd93d90a715586d73801d9b47471c601ffffffff0100714460030000001976a914c7b55141d097ea5df7a0ed330cf794376e53ec8d88ac0000000001000000045bf0e214aa4069a3e792ecee1e1bf0c1d397cde8dd08138f4b72a00681743447000000008b48304502200c45de8c4f3e2c1821f2fc878cba97b1e6f8807d94930713aa1c86a67b9bf1e40221008581abfef2e30f957815fc89978423746b2086375ca8ecf359c85c2a5b7c88ad01410462bb73f76ca0994fcb8b4271e6fb7561f5c0f9ca0cf6485261c4a0dc894f4ab844c6cdfb97cd0b60ffb5018ffd6238f4d87270efb1d3ae37079b794a92d7ec95ffffffffd669f7d7958d40fc59d2253d88e0f248e29b599c80bbcec344a83dda5f9aa72c000000008a473044022078124c8beeaa825f9e0b30bff96e564dd859432f2d0cb3b72d3d5d93d38d7e930220691d233b6c0f995be5acb03d70a7f7a65b6bc9bdd426260f38a1346669507a3601410462bb73f76ca0994fcb8b4271e6fb7561f5c0f9ca0cf6485261c4a0dc894f4ab844c6cdfb97cd0b60ffb5018ffd6238f4d87270efb1d3ae37079b794a92d7ec95fffffffff878af0d93f5229a68166cf051fd372bb7a537232946e0a46f53636b4dafdaa4000000008c493046022100c717d1714551663f69c3c5759bdbb3a0fcd3fab023abc0e522fe6440de35d8290221008d9cbe25bffc44af2b18e81c58eb37293fd7fe1c2e7b46fc37ee8c96c50ab1e201410462bb73f76ca0994fcb8b4271e6fb7561f5c0f9ca0cf6485261c4a0dc894f4ab844c6cdfb97cd0b60ffb5018ffd6238f4d87270efb1d3ae37079b794a92d7ec95ffffffff27f2b668859cd7f2f894aa0fd2d9e60963bcd07c88973f425f999b8cbfd7a1e2000000008c493046022100e00847147cbf517bcc2f502f3ddc6d284358d102ed20d47a8aa788a62f0db780022100d17b2d6fa84dcaf1c95d88d7e7c30385aecf415588d749afd3ec81f6022cecd701410462bb73f76ca0994fcb8b4271e6fb7561f5c0f9ca0cf6485261c4a0dc894f4ab844c6cdfb97cd0b60ffb5018ffd6238f4d87270efb1d3ae37079b794a92d7ec95ffffffff0100c817a8040000001976a914b6efd80d99179f4f4ff6f4dd0a007d018c385d2188ac000000000100000001834537b2f1ce8ef9373a258e10545ce5a50b758df616cd4356e0032554ebd3c4000000008b483045022100e68f422dd7c34fdce11eeb4509ddae38201773dd62f284e8aa9d96f85099d0b002202243bd399ff96b649a0fad05fa759d6a882f0af8c90cf7632c2840c29070aec20141045e58067e815c2f464c6a2a15f987758374203895710c2d452442e28496ff38ba8f5fd901dc20e29e88477167fe4fc299bf818fd0d9e1632d467b2a3d9503b1aaffffffff0280d7e636030000001976a914f34c3e10eb387efe872acb614c89e78bfca7815d88ac404b4c00000000001976a914a84e272933aaf87e1715d7786c51dfaeb5b65a6f88ac00000000010000000143ac81c8e6f6ef307dfe17f3d906d999e23e0189fda838c5510d850927e03ae7000000008c4930460221009c87c344760a64cb8ae6685a3eec2c1ac1bed5b88c87de51acd0e124f266c16602210082d07c037359c3a257b5c63ebd90f5a5edf97b2ac1c434b08ca998839f346dd40141040ba7e521fa7946d12edbb1d1e95a15c34bd4398195e86433c92b431cd315f455fe30032ede69cad9d1e1ed6c3c4ec0dbfced53438c625462afb792dcb098544bffffffff0240420f00000000001976a9144676d1b820d63ec272f1900d59d43bc6463d96f888ac40420f00000000001976a914648d04341d00d7968b3405c034adc38d4d8fb9bd88ac00000000010000000248cc917501ea5c55f4a8d2009c0567c40cfe037c2e71af017d0a452ff705e3f1000000008b483045022100bf5fdc86dc5f08a5d5c8e43a8c9d5b1ed8c65562e280007b52b133021acd9acc02205e325d613e555f772802bf413d36ba807892ed1a690a77811d3033b3de226e0a01410429fa713b124484cb2bd7b5557b2c0b9df7b2b1fee61825eadc5ae6c37a9920d38bfccdc7dc3cb0c47d7b173dbc9db8d37db0a33ae487982c59c6f8606e9d1791ffffffff41ed70551dd7e841883ab8f0b16bf04176b7d1480e4f0af9f3d4c3595768d068000000008b4830450221008513ad65187b903aed1102d1d0c47688127658c51106753fed0151ce9c16b80902201432b9ebcb87bd04ceb2de66035fbbaf4bf8b00d1cfe41f1a1f7338f9ad79d210141049d4cf80125bf50be1709f718c07ad15d0fc612b7da1f5570dddc35f2a352f0f27c978b06820edca9ef982c35fda2d255afba340068c5035552368bc7200c1488ffffffff0100093d00000000001976a9148edb68822f1ad580b043c7b3df2e400f8699eb4888ac00000000"), SER_NETWORK, PROTOCOL_VERSION);
+    stream >> block;
+
+    // Elements are extracted once and reused for every filter, as for cached filtered blocks
+    vector<CBloomFilterElements> vElements;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vElements.push_back(CBloomFilterElements(tx, tx.GetHash()));
+
+    for (unsigned char nFlags = BLOOM_UPDATE_NONE; nFlags < BLOOM_UPDATE_MASK; nFlags++)
+    {
+        CBloomFilter filter(10, 0.000001, 0, nFlags);
+        filter.insert(ParseHex("04eaafc2314def4ca98ac970241bcab022b9c1e1f4ea423a20f134c876f2c01ec0f0dd5b2e86e7168cefe0d81113c3807420ce13ad1357231a2252247d97a46a91"));
+        filter.insert(ParseHex("b6efd80d99179f4f4ff6f4dd0a007d018c385d21"));
+        CBloomFilter filter2 = filter;
+
+        CMerkleBlock merkleBlock(block, filter);
+        CMerkleBlock merkleBlock2(block.GetBlockHeader(), vElements, filter2);
+        BOOST_CHECK(merkleBlock.vMatchedTxn == merkleBlock2.vMatchedTxn);
+
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION), ss2(SER_NETWORK, PROTOCOL_VERSION);
+        ss << merkleBlock << filter;
+        ss2 << merkleBlock2 << filter2;
+        BOOST_CHECK(ss.str() == ss2.str());
+    }
+}
+
 BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
 {
     // Random real block (000000000000b731f2eef9e8c63173adfb07e41bd53eb0ef0a6b720d6cb6dea4)
@@ -443,4 +474,85 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(murmurhash3_multi)
+{
+    vector<unsigned char> vch;
+    for (unsigned int nLen = 0; nLen < 40; nLen++)
+    {
+        unsigned int vnHash[MAX_HASH_FUNCS];
+        const unsigned char* pbegin = vch.empty() ? NULL : &vch[0];
+        MurmurHash3Multi(nLen, 0xFBA4C795, pbegin, pbegin + vch.size(), vnHash, MAX_HASH_FUNCS);
+        for (unsigned int i = 0; i < MAX_HASH_FUNCS; i++)
+            BOOST_CHECK_EQUAL(vnHash[i], MurmurHash3(nLen + i * 0xFBA4C795, vch));
+        vch.push_back(GetRandInt(256));
+    }
+}
+
+// Throughput of filter lookups, against one MurmurHash3 call per hash function on a copy of the key
+BOOST_AUTO_TEST_CASE(bloom_throughput)
+{
+    static const int nKeys = 20000;
+    CBloomFilter filter(nKeys, 0.0001, 0, BLOOM_UPDATE_NONE);
+    vector<uint256> vHash;
+    for (int i = 0; i < nKeys; i++)
+    {
+        vHash.push_back(GetRandHash());
+        if (i % 2 == 0)
+            filter.insert(vHash.back());
+    }
+
+    int nFound = 0;
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < nKeys; i++)
+        if (filter.contains(vHash[i]))
+            nFound++;
+    int64 nFilter = GetTimeMicros() - nStart;
+    BOOST_CHECK(nFound >= nKeys / 2 && nFound < nKeys / 2 + 20);
+
+    // The same hashes as computed before the single-pass kernel; a 0.01% fp rate takes 13 of them
+    static const unsigned int nHashFuncs = 13;
+    unsigned int nSum = 0;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nKeys; i++)
+    {
+        vector<unsigned char> vKey(vHash[i].begin(), vHash[i].end());
+        for (unsigned int j = 0; j < nHashFuncs; j++)
+            nSum += MurmurHash3(j * 0xFBA4C795, vKey);
+    }
+    int64 nReference = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("bloom contains: %.3fus/key, %u separate hashes: %.3fus/key (%u)",
+                                 (double)nFilter / nKeys, nHashFuncs, (double)nReference / nKeys, nSum));
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // Remembers the last 100 items at a 1% false positive rate
+    CRollingBloomFilter rb(100, 0.01, 0);
+    vector<uint256> vHash;
+    for (int i = 0; i < 1000; i++)
+        vHash.push_back(GetRandHash());
+
+    int nFalse = 0;
+    for (int i = 0; i < 1000; i++) {
+        if (rb.contains(vHash[i]))
+            nFalse++;
+        rb.insert(vHash[i]);
+        for (int j = max(0, i - 99); j <= i; j++)
+            BOOST_CHECK(rb.contains(vHash[j]));
+    }
+    // expected ~10, generous margin
+    BOOST_CHECK(nFalse < 40);
+
+    // items from long ago are mostly forgotten
+    int nOld = 0;
+    for (int i = 0; i < 500; i++)
+        if (rb.contains(vHash[i]))
+            nOld++;
+    BOOST_CHECK(nOld < 40);
+
+    rb.clear();
+    BOOST_CHECK(!rb.contains(vHash[999]));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
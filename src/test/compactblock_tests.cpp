@@ -0,0 +1,98 @@
+#include <boost/test/unit_test.hpp>
+
+#include "hash.h"
+#include "main.h"
+
+using namespace std;
+
+static CBlock BuildBlock(unsigned int nTx)
+{
+    CBlock block;
+    for (unsigned int i = 0; i < nTx; i++) {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vout.resize(1);
+        tx.vin[0].prevout.n = i;
+        tx.nLockTime = i; // actual transaction data doesn't matter; just make them unique
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.nBits = 0x207fffff;
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // reference vector: key 00..0f, message 00..1f
+    std::vector<unsigned char> vch;
+    for (int i = 0; i < 32; i++)
+        vch.push_back(i);
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256(vch)), 0x7127512f72f27cceULL);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_roundtrip)
+{
+    CBlock block = BuildBlock(20);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), 20U);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    BOOST_CHECK_EQUAL(ss.size(), 80 + 8 + 1 + 19 * CBlockHeaderAndShortTxIDs::SHORTTXIDS_LENGTH + ::GetSerializeSize(cmpctblock.vPrefilledTxn, SER_NETWORK, PROTOCOL_VERSION));
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    ss >> cmpctblock2;
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblock2.vShortTxIDs == cmpctblock.vShortTxIDs);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        BOOST_CHECK_EQUAL(cmpctblock2.GetShortID(block.vtx[i].GetHash()), cmpctblock.vShortTxIDs[i - 1]);
+
+    // Half the transactions are in the pool, plus one unrelated
+    CTxMemPool pool;
+    for (unsigned int i = 1; i < block.vtx.size(); i += 2)
+        pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+    CTransaction txOther = BuildBlock(30).vtx[25];
+    pool.addUnchecked(txOther.GetHash(), txOther);
+
+    CValidationState state;
+    CPartialBlock partial;
+    BOOST_CHECK(partial.Init(state, cmpctblock2, pool));
+    vector<unsigned int> vMissing;
+    partial.GetMissing(vMissing);
+    BOOST_CHECK_EQUAL(vMissing.size(), 9U);
+
+    vector<CTransaction> vtx;
+    BOOST_FOREACH(unsigned int nIndex, vMissing) {
+        BOOST_CHECK(nIndex % 2 == 0 && nIndex > 0);
+        vtx.push_back(block.vtx[nIndex]);
+    }
+    CBlock block2;
+    BOOST_CHECK(!partial.Fill(vector<CTransaction>(vtx.begin(), vtx.end() - 1), block2));
+    BOOST_CHECK(partial.Fill(vtx, block2));
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+    BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_invalid)
+{
+    CBlock block = BuildBlock(3);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    CTxMemPool pool;
+
+    // prefilled index beyond the block
+    cmpctblock.vPrefilledTxn[0].nIndex = 3;
+    CValidationState state;
+    CPartialBlock partial;
+    BOOST_CHECK(!partial.Init(state, cmpctblock, pool));
+    BOOST_CHECK(state.IsInvalid());
+
+    // duplicate short IDs need the full block, but aren't the sender's fault
+    cmpctblock.vPrefilledTxn[0].nIndex = 0;
+    cmpctblock.vShortTxIDs[1] = cmpctblock.vShortTxIDs[0];
+    CValidationState state2;
+    BOOST_CHECK(!partial.Init(state2, cmpctblock, pool));
+    BOOST_CHECK(state2.IsValid());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
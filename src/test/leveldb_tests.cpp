@@ -0,0 +1,117 @@
+#include <boost/test/unit_test.hpp>
+
+#include "leveldb.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static CCoins RandomCoins(int nOutputs)
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = GetRandInt(250000);
+    coins.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        coins.vout[i].nValue = GetRand(21000000 * COIN);
+        coins.vout[i].scriptPubKey << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, (unsigned char)i) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return coins;
+}
+
+BOOST_AUTO_TEST_SUITE(leveldb_tests)
+
+// CLevelDBWriter must produce the same bytes as CDataStream, both in its inline buffer and after spilling
+BOOST_AUTO_TEST_CASE(leveldb_writer)
+{
+    uint256 hash = GetRandHash();
+    CLevelDBWriter ssKey;
+    ssKey << make_pair('c', hash);
+    CDataStream ssRef(SER_DISK, CLIENT_VERSION);
+    ssRef << make_pair('c', hash);
+    BOOST_CHECK_EQUAL(ssKey.GetSlice().ToString(), ssRef.str());
+
+    std::string strLong(1000, 'x');
+    ssKey << strLong;
+    ssRef << strLong;
+    BOOST_CHECK_EQUAL(ssKey.GetSlice().ToString(), ssRef.str());
+
+    ssKey.clear();
+    BOOST_CHECK(ssKey.GetSlice().empty());
+    ssKey << 'B';
+    BOOST_CHECK_EQUAL(ssKey.GetSlice().ToString(), std::string("B"));
+
+    // reading back in place
+    std::string strRef = ssRef.str();
+    CLevelDBReader ssRead(strRef);
+    pair<char, uint256> key;
+    std::string str;
+    ssRead >> key >> str;
+    BOOST_CHECK(key.first == 'c' && key.second == hash);
+    BOOST_CHECK(str == strLong);
+    BOOST_CHECK(ssRead.empty());
+    BOOST_CHECK_THROW(ssRead >> key, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(leveldb_coins_lookup)
+{
+    CLevelDB db(GetTempPath() / "test_leveldb", 1 << 22, true);
+
+    static const int nCoins = 20000;
+    vector<uint256> vHash;
+    vector<CCoins> vCoins;
+    CLevelDBBatch batch;
+    for (int i = 0; i < nCoins; i++) {
+        vHash.push_back(GetRandHash());
+        vCoins.push_back(RandomCoins(1 + i % 4));
+        batch.Write(make_pair('c', vHash.back()), vCoins.back());
+    }
+    BOOST_CHECK(db.WriteBatch(batch));
+
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < nCoins; i++) {
+        CCoins coins;
+        BOOST_CHECK(db.Read(make_pair('c', vHash[i]), coins));
+        BOOST_CHECK(coins.vout == vCoins[i].vout && coins.nHeight == vCoins[i].nHeight);
+    }
+    int64 nRead = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nCoins; i++)
+        BOOST_CHECK(!db.Exists(make_pair('c', GetRandHash())));
+    int64 nMiss = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("coins lookup: %.2fus/hit, %.2fus/miss", (double)nRead / nCoins, (double)nMiss / nCoins));
+
+    BOOST_CHECK(db.Erase(make_pair('c', vHash[0])));
+    BOOST_CHECK(!db.Exists(make_pair('c', vHash[0])));
+}
+
+// chunked writes as done by CCoinsViewDB::BatchWrite for large flushes
+BOOST_AUTO_TEST_CASE(leveldb_batch_chunks)
+{
+    CLevelDB db(GetTempPath() / "test_leveldb", 1 << 20, true);
+
+    CLevelDBBatch batch;
+    BOOST_CHECK_EQUAL(batch.SizeEstimate(), 0U);
+    vector<uint256> vHash;
+    for (int i = 0; i < 1000; i++) {
+        vHash.push_back(GetRandHash());
+        batch.Write(make_pair('c', vHash.back()), i);
+        if (batch.SizeEstimate() >= 4096) {
+            BOOST_CHECK(db.WriteBatch(batch));
+            batch.Clear();
+            BOOST_CHECK_EQUAL(batch.SizeEstimate(), 0U);
+        }
+    }
+    BOOST_CHECK(batch.SizeEstimate() < 4096);
+    BOOST_CHECK(db.WriteBatch(batch));
+
+    for (int i = 0; i < 1000; i++) {
+        int n;
+        BOOST_CHECK(db.Read(make_pair('c', vHash[i]), n));
+        BOOST_CHECK_EQUAL(n, i);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,7 +2,9 @@
 
 using namespace std;
 
+#include "bloom.h"
 #include "mruset.h"
+#include "protocol.h"
 #include "util.h"
 
 #define NUM_TESTS 16
@@ -87,4 +89,45 @@ BOOST_AUTO_TEST_CASE(mruset_window)
     }
 }
 
+// Known-inventory tracking as done per peer: mruset<CInv> against the rolling bloom filter
+BOOST_AUTO_TEST_CASE(mruset_vs_rolling_bloom)
+{
+    static const unsigned int nKnown = 5000;
+    static const int nOps = 100000;
+    vector<CInv> vInv;
+    for (int i = 0; i < nOps; i++)
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+
+    // Each new inv is looked up, inserted, and then a recent one is looked up again
+    mruset<CInv> setKnown(nKnown);
+    int nHits = 0;
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < nOps; i++) {
+        if (setKnown.insert(vInv[i]).second)
+            nHits++;
+        if (setKnown.count(vInv[i - i % nKnown]))
+            nHits++;
+    }
+    int64 nSet = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(nHits, 2 * nOps);
+
+    CRollingBloomFilter filterKnown(nKnown, 0.000001, 0);
+    nHits = 0;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nOps; i++) {
+        if (!filterKnown.contains(vInv[i].hash)) {
+            filterKnown.insert(vInv[i].hash);
+            nHits++;
+        }
+        if (filterKnown.contains(vInv[i - i % nKnown].hash))
+            nHits++;
+    }
+    int64 nFilter = GetTimeMicros() - nStart;
+    // allow for the odd false positive on new items
+    BOOST_CHECK(nHits > 2 * nOps - 5);
+
+    BOOST_TEST_MESSAGE(strprintf("known inventory: mruset %.2fus/op, rolling bloom %.2fus/op",
+                                 (double)nSet / (2 * nOps), (double)nFilter / (2 * nOps)));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
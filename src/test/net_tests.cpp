@@ -0,0 +1,177 @@
+//
+// Unit tests for transaction inv batching and block download scheduling
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+// Tests these internal-to-main.cpp and net.cpp methods:
+extern unsigned int MaxBlocksInFlight(CNode* pto);
+extern double dBestBlockDownloadRate;
+extern double NodeSyncScore(const CNode *pnode);
+extern bool SyncNodeStalled(CNode *pnode);
+extern void StartSync(const vector<CNode*> &vNodes);
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(poisson_next_send)
+{
+    const int64 nNow = 1000000000000LL;
+    const int nInterval = 1000; // milliseconds
+    const int nDraws = 10000;
+    double dTotal = 0;
+    for (int i = 0; i < nDraws; i++)
+    {
+        int64 nNext = PoissonNextSend(nNow, nInterval);
+        // 48 random bits allow gaps of up to ln(2^48) = 33.3 intervals
+        BOOST_CHECK(nNext >= nNow);
+        BOOST_CHECK(nNext <= nNow + 34 * nInterval * 1000LL);
+        dTotal += nNext - nNow;
+    }
+    // The standard deviation of the mean is 1% here
+    double dMean = dTotal / nDraws;
+    BOOST_CHECK(dMean > 0.95 * nInterval * 1000);
+    BOOST_CHECK(dMean < 1.05 * nInterval * 1000);
+
+    BOOST_CHECK_EQUAL(PoissonNextSend(nNow, 0), nNow);
+}
+
+BOOST_AUTO_TEST_CASE(inventory_dedup)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 8333)), "", true);
+    vector<uint256> vHashes;
+    for (int i = 0; i < 5; i++)
+        vHashes.push_back(GetRandHash());
+
+    // Queueing a transaction twice announces it once
+    BOOST_FOREACH(const uint256& hash, vHashes)
+    {
+        node.PushInventory(CInv(MSG_TX, hash));
+        node.PushInventory(CInv(MSG_TX, hash));
+    }
+    BOOST_CHECK_EQUAL(node.mapInventoryTxToSend.size(), vHashes.size());
+
+    // Nor are transactions the peer told us about
+    node.AddInventoryKnown(CInv(MSG_TX, vHashes[0]));
+    vector<CInv> vInv;
+    SelectInventoryBatch(node.mapInventoryTxToSend, node.filterInventoryKnown, MAX_INV_TRICKLE, vInv);
+    BOOST_CHECK_EQUAL(vInv.size(), vHashes.size() - 1);
+    BOOST_CHECK(node.mapInventoryTxToSend.empty());
+
+    // Once sent, they are not queued again
+    BOOST_FOREACH(const uint256& hash, vHashes)
+        node.PushInventory(CInv(MSG_TX, hash));
+    BOOST_CHECK(node.mapInventoryTxToSend.empty());
+}
+
+BOOST_AUTO_TEST_CASE(inventory_batch)
+{
+    map<uint256, uint64> mapToSend;
+    map<uint256, uint64> mapQueued;
+    CRollingBloomFilter filterKnown(INVENTORY_KNOWN_SIZE, INVENTORY_KNOWN_FPRATE, GetRand(0xffffffff));
+    for (uint64 n = 0; n < 100; n++)
+        mapToSend.insert(make_pair(GetRandHash(), n));
+    mapQueued = mapToSend;
+
+    // Batches of at most nMax, each in the order queued, until all went out once
+    set<uint256> setSent;
+    for (int nBatch = 0; nBatch < 10; nBatch++)
+    {
+        vector<CInv> vInv;
+        SelectInventoryBatch(mapToSend, filterKnown, 10, vInv);
+        BOOST_CHECK_EQUAL(vInv.size(), 10U);
+        for (unsigned int i = 0; i < vInv.size(); i++)
+        {
+            BOOST_CHECK(setSent.insert(vInv[i].hash).second);
+            if (i > 0)
+                BOOST_CHECK(mapQueued[vInv[i - 1].hash] < mapQueued[vInv[i].hash]);
+        }
+    }
+    BOOST_CHECK(mapToSend.empty());
+    BOOST_CHECK_EQUAL(setSent.size(), 100U);
+}
+
+BOOST_AUTO_TEST_CASE(blocks_in_flight)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 8333)), "", true);
+    double dBestRateSaved = dBestBlockDownloadRate;
+    dBestBlockDownloadRate = 1000000;
+
+    // Unmeasured and fastest peers get the full allowance
+    BOOST_CHECK_EQUAL(MaxBlocksInFlight(&node), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    node.dBlockDownloadRate = 2000000;
+    BOOST_CHECK_EQUAL(MaxBlocksInFlight(&node), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    node.dBlockDownloadRate = 1000000;
+    BOOST_CHECK_EQUAL(MaxBlocksInFlight(&node), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // Slower ones in proportion to their rate, but always at least one
+    node.dBlockDownloadRate = 250000;
+    BOOST_CHECK_EQUAL(MaxBlocksInFlight(&node), MAX_BLOCKS_IN_TRANSIT_PER_PEER / 4);
+    node.dBlockDownloadRate = 1;
+    BOOST_CHECK_EQUAL(MaxBlocksInFlight(&node), 1U);
+
+    dBestBlockDownloadRate = dBestRateSaved;
+}
+
+BOOST_AUTO_TEST_CASE(sync_node_stall)
+{
+    CNode nodeFast(INVALID_SOCKET, CAddress(CService("127.0.0.1", 8333)), "", true);
+    CNode nodeSlow(INVALID_SOCKET, CAddress(CService("127.0.0.2", 8333)), "", true);
+    CNode nodeUnmeasured(INVALID_SOCKET, CAddress(CService("127.0.0.3", 8333)), "", true);
+    vector<CNode*> vNodes;
+    vNodes.push_back(&nodeSlow);
+    vNodes.push_back(&nodeFast);
+    vNodes.push_back(&nodeUnmeasured);
+    int nHeaderHeight = pindexBestHeader ? pindexBestHeader->nHeight : -1;
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        pnode->fSuccessfullyConnected = true;
+        pnode->nStartingHeight = nHeaderHeight + 1000;
+        pnode->nMinPingUsecTime = 100000;
+    }
+    nodeFast.dBlockDownloadRate = 1000000;
+    nodeSlow.dBlockDownloadRate = 10000;
+
+    // A measured fast node beats an unmeasured one, which beats a slow one
+    BOOST_CHECK(NodeSyncScore(&nodeFast) > NodeSyncScore(&nodeUnmeasured));
+    BOOST_CHECK(NodeSyncScore(&nodeUnmeasured) > NodeSyncScore(&nodeSlow));
+    StartSync(vNodes);
+    BOOST_CHECK(nodeFast.fStartSync);
+    nodeFast.fStartSync = false;
+
+    // The sync node stalls once the headers make no progress for a while
+    SetMockTime(GetTime());
+    BOOST_CHECK(!SyncNodeStalled(&nodeFast));
+    SetMockTime(GetTime() + SYNC_STALL_TIMEOUT);
+    BOOST_CHECK(!SyncNodeStalled(&nodeFast));
+    SetMockTime(GetTime() + 1);
+    BOOST_CHECK(SyncNodeStalled(&nodeFast));
+
+    // but not if it has no more headers than we do
+    nodeFast.nStartingHeight = nHeaderHeight;
+    BOOST_CHECK(!SyncNodeStalled(&nodeFast));
+    SetMockTime(0);
+
+    // A stalled node is passed over until every candidate has stalled
+    nodeFast.fSyncStalled = true;
+    StartSync(vNodes);
+    BOOST_CHECK(!nodeFast.fStartSync);
+    BOOST_CHECK(nodeUnmeasured.fStartSync);
+    nodeUnmeasured.fSyncStalled = true;
+    nodeSlow.fSyncStalled = true;
+    StartSync(vNodes);
+    BOOST_CHECK(!nodeFast.fSyncStalled);
+    BOOST_CHECK(!nodeSlow.fSyncStalled);
+    BOOST_CHECK(!nodeUnmeasured.fSyncStalled);
+
+    // Forget the sync node chosen from these
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        pnode->CloseSocketDisconnect();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 #include <vector>
 
 #include "netbase.h"
+#include "util.h"
 
 using namespace std;
 
@@ -99,4 +100,133 @@ BOOST_AUTO_TEST_CASE(onioncat_test)
     BOOST_CHECK(addr1.IsRoutable());
 }
 
+// Drive a CConnectAttempt to completion the way ThreadOpenConnections does
+static bool RunConnectAttempt(CConnectAttempt& attempt)
+{
+    for (int i = 0; i < 50; i++)
+    {
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(attempt.GetSocket(), &fdset);
+        struct timeval timeout = {0, 100000};
+        if (attempt.WantWrite())
+            select(attempt.GetSocket() + 1, NULL, &fdset, NULL, &timeout);
+        else
+            select(attempt.GetSocket() + 1, &fdset, NULL, NULL, &timeout);
+        if (!attempt.Step())
+            return attempt.IsConnected();
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(netbase_connect_attempt)
+{
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&sockaddr, len) != SOCKET_ERROR);
+    BOOST_REQUIRE(listen(hListen, 1) != SOCKET_ERROR);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&sockaddr, &len) != SOCKET_ERROR);
+    CService addr(CNetAddr("127.0.0.1"), ntohs(sockaddr.sin_port));
+
+    CConnectAttempt attempt;
+    BOOST_CHECK(attempt.Start(addr));
+    BOOST_CHECK(RunConnectAttempt(attempt));
+    SOCKET hSocket = attempt.Release();
+    BOOST_CHECK(hSocket != INVALID_SOCKET);
+    closesocket(hSocket);
+    closesocket(hListen);
+
+    // nothing listening any more: the attempt fails and gives up its socket
+    CConnectAttempt attempt2;
+    if (attempt2.Start(addr))
+        BOOST_CHECK(!RunConnectAttempt(attempt2));
+    BOOST_CHECK(!attempt2.IsConnected());
+}
+
+// Resolver whose names are answered by a stub: "slow" names wait for Release()
+class CStubResolver : public CAsyncResolver
+{
+public:
+    CStubResolver() : CAsyncResolver(4, 60), nLookups(0), fReleased(false) {}
+    ~CStubResolver() { Release(); Stop(); }
+
+    int GetLookups()
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStub);
+        return nLookups;
+    }
+
+    void Release()
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStub);
+        fReleased = true;
+        condReleased.notify_all();
+    }
+
+protected:
+    bool DoLookup(const std::string& strName, std::vector<CNetAddr>& vIP)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStub);
+        nLookups++;
+        // don't hang the test if the resolver is broken
+        boost::system_time timeout = boost::get_system_time() + boost::posix_time::seconds(30);
+        if (strName.compare(0, 4, "slow") == 0)
+            while (!fReleased && condReleased.timed_wait(lock, timeout));
+        if (strName.compare(0, 7, "invalid") == 0)
+            return false;
+        vIP.push_back(CNetAddr("10.0.0.1"));
+        vIP.push_back(CNetAddr("10.0.0.2"));
+        return true;
+    }
+
+private:
+    boost::mutex mutexStub;
+    boost::condition_variable condReleased;
+    int nLookups;
+    bool fReleased;
+};
+
+BOOST_AUTO_TEST_CASE(netbase_resolver)
+{
+    CStubResolver stub;
+    vector<CNetAddr> vIP;
+    BOOST_CHECK(!stub.Poll("seed.example", vIP));
+
+    // a slow name doesn't hold up the others
+    stub.Request("slow.example");
+    stub.Request("seed.example");
+    BOOST_CHECK(stub.Lookup("seed.example", vIP));
+    BOOST_CHECK_EQUAL(vIP.size(), 2U);
+    BOOST_CHECK(!stub.Poll("slow.example", vIP));
+    stub.Release();
+    BOOST_CHECK(stub.Lookup("slow.example", vIP));
+    BOOST_CHECK(stub.Poll("slow.example", vIP));
+    BOOST_CHECK(vIP[0] == CNetAddr("10.0.0.1"));
+
+    BOOST_CHECK(!stub.Lookup("invalid.example", vIP));
+    BOOST_CHECK(stub.Poll("invalid.example", vIP));
+    BOOST_CHECK(vIP.empty());
+
+    // results are cached until they expire
+    BOOST_CHECK_EQUAL(stub.GetLookups(), 3);
+    BOOST_CHECK(stub.Lookup("seed.example", vIP));
+    BOOST_CHECK_EQUAL(stub.GetLookups(), 3);
+    SetMockTime(GetTime() + 61);
+    BOOST_CHECK(stub.Lookup("seed.example", vIP));
+    BOOST_CHECK_EQUAL(stub.GetLookups(), 4);
+
+    // long expired results are forgotten
+    BOOST_CHECK(stub.Poll("slow.example", vIP));
+    SetMockTime(GetTime() + 60);
+    stub.Request("other.example");
+    BOOST_CHECK(!stub.Poll("slow.example", vIP));
+    BOOST_CHECK(!stub.Poll("invalid.example", vIP));
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,78 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+#define SKIPLIST_LENGTH 300000
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(skiplist_tests)
+
+BOOST_AUTO_TEST_CASE(skiplist_test)
+{
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        if (i > 0) {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < i);
+        } else {
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+        }
+    }
+
+    for (int i=0; i < 1000; i++) {
+        int from = GetRandInt(SKIPLIST_LENGTH - 1);
+        int to = GetRandInt(from + 1);
+
+        BOOST_CHECK(vIndex[SKIPLIST_LENGTH - 1].GetAncestor(from) == &vIndex[from]);
+        BOOST_CHECK(vIndex[from].GetAncestor(to) == &vIndex[to]);
+        BOOST_CHECK(vIndex[from].GetAncestor(0) == &vIndex[0]);
+    }
+
+    BOOST_CHECK(vIndex[10].GetAncestor(11) == NULL);
+    BOOST_CHECK(vIndex[10].GetAncestor(-1) == NULL);
+}
+
+// Locators built from a side branch must step back exponentially, ending at genesis
+BOOST_AUTO_TEST_CASE(skiplist_locator)
+{
+    std::vector<CBlockIndex> vIndex(10000);
+    std::vector<uint256> vHash(10000);
+
+    for (unsigned int i=0; i<vIndex.size(); i++) {
+        vHash[i] = i;
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].BuildSkip();
+    }
+
+    CBlockLocator locator(&vIndex.back());
+    CDataStream ss(SER_GETHASH, 0);
+    ss << locator;
+    std::vector<uint256> vHave;
+    ss >> vHave;
+    BOOST_CHECK(vHave.front() == vHash.back());
+    BOOST_CHECK(vHave.back() == vHash[0]);
+
+    // Heights are decreasing; the first 11 steps go back by one, then the step doubles
+    for (unsigned int i=1; i<vHave.size(); i++) {
+        int nHeight = (int)vHave[i].Get64();
+        int nPrevHeight = (int)vHave[i - 1].Get64();
+        BOOST_CHECK(nHeight < nPrevHeight);
+        if (i <= 11)
+            BOOST_CHECK_EQUAL(nPrevHeight - nHeight, 1);
+        else if (nHeight > 0)
+            BOOST_CHECK_EQUAL(nPrevHeight - nHeight, 1 << (i - 11));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
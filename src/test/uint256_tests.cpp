@@ -15,4 +15,53 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+BOOST_AUTO_TEST_CASE(uint256_arith)
+{
+    uint256 a("0x3fb3ab764c00");
+    BOOST_CHECK_EQUAL(a.bits(), 46U);
+    BOOST_CHECK_EQUAL(uint256(0).bits(), 0U);
+    BOOST_CHECK_EQUAL(uint256(1).bits(), 1U);
+    BOOST_CHECK_EQUAL((~uint256(0)).bits(), 256U);
+
+    BOOST_CHECK(a * 6 == uint256("0x17e3604c5c800"));
+    BOOST_CHECK(a * 6 / uint256(6) == a);
+    BOOST_CHECK(a / a == 1);
+    BOOST_CHECK(a / (a + 1) == 0);
+    BOOST_CHECK(uint256(1000) / uint256(7) == 142);
+
+    // 2**256 / 2**128 == 2**128, computed without overflowing
+    uint256 b = uint256(1) << 128;
+    BOOST_CHECK(~uint256(0) / b == b - 1);
+    BOOST_CHECK(~uint256(0) * 2 == ~uint256(0) - 1);
+}
+
+BOOST_AUTO_TEST_CASE(uint256_SetCompact)
+{
+    bool fNegative, fOverflow;
+    uint256 num;
+
+    num.SetCompact(0x1d00ffff, &fNegative, &fOverflow);
+    BOOST_CHECK_EQUAL(num.GetHex(), "00000000ffff0000000000000000000000000000000000000000000000000000");
+    BOOST_CHECK(!fNegative && !fOverflow);
+
+    num.SetCompact(0x01123456, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0x12);
+    BOOST_CHECK(!fNegative && !fOverflow);
+
+    num.SetCompact(0x04923456, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0x12345600);
+    BOOST_CHECK(fNegative && !fOverflow);
+
+    num.SetCompact(0x00800000, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0);
+    BOOST_CHECK(!fNegative && !fOverflow);
+
+    num.SetCompact(0x23000001, &fNegative, &fOverflow);
+    BOOST_CHECK(fOverflow);
+    num.SetCompact(0x21010000, &fNegative, &fOverflow);
+    BOOST_CHECK(fOverflow);
+    num.SetCompact(0x20010000, &fNegative, &fOverflow);
+    BOOST_CHECK(!fOverflow);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
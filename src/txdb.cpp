@@ -6,9 +6,17 @@
 #include "txdb.h"
 #include "main.h"
 #include "hash.h"
+#include "init.h"
+
+#include <boost/bind.hpp>
 
 using namespace std;
 
+CCoinsViewDB *pcoinsdbview = NULL;
+
+// flushes larger than this are written to the coin database in several batches
+static const size_t nBulkWriteChunkSize = 16 << 20;
+
 void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
     if (coins.IsPruned())
         batch.Erase(make_pair('c', hash));
@@ -23,6 +31,9 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
 }
 
+CCoinsViewDB::CCoinsViewDB(const CLevelDBProfile &profile, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", profile, fMemory, fWipe) {
+}
+
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) { 
     return db.Read(make_pair('c', txid), coins); 
 }
@@ -41,7 +52,7 @@ CBlockIndex *CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return NULL;
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+    BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
     if (it == mapBlockIndex.end())
         return NULL;
     return it->second;
@@ -56,18 +67,52 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
 bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
     printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
 
+    // Large flushes (typically during initial block download) are not built up as one
+    // giant WriteBatch, which would hold a second copy of the whole cache in memory and
+    // force it into a single oversized memtable. Instead they are written in chunks,
+    // bracketed by a fence record naming the new best block: LevelDB replays its log in
+    // order, so if any chunk survives a crash the fence does too, and it is only removed
+    // by the final chunk together with the new best block. After a crash, the blocks
+    // from the old best block to the fenced one are replayed (see LoadBlockIndexDB),
+    // which is only possible if the write extends the chain; other writes (reorgs) go
+    // out as a single batch.
+    CBlockIndex *pindexOld = pindex ? GetBestBlock() : NULL;
+    bool fChunked = pindexOld && pindex->GetAncestor(pindexOld->nHeight) == pindexOld;
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+    bool fBulk = false;
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         BatchWriteCoins(batch, it->first, it->second);
+        if (fChunked && batch.SizeEstimate() >= nBulkWriteChunkSize) {
+            if (!fBulk) {
+                if (!db.Write('W', pindex->GetBlockHash()))
+                    return false;
+                fBulk = true;
+            }
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+        }
+    }
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
+    if (fBulk) {
+        batch.Erase('W');
+        printf("Bulk coin database write finished\n");
+    }
 
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::ReadBulkWriteTarget(uint256 &hashTarget) {
+    return db.Read('W', hashTarget);
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
+CBlockTreeDB::CBlockTreeDB(const CLevelDBProfile &profile, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", profile, fMemory, fWipe) {
+}
+
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
@@ -111,6 +156,10 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
+void CCoinsViewDB::Compact() {
+    db.Compact();
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
     leveldb::Iterator *pcursor = db.NewIterator();
     pcursor->SeekToFirst();
@@ -122,13 +171,12 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CLevelDBReader ssKey(pcursor->key());
             char chType;
             ssKey >> chType;
             if (chType == 'c') {
                 leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CLevelDBReader ssValue(slValue);
                 CCoins coins;
                 ssValue >> coins;
                 uint256 txhash;
@@ -185,59 +233,123 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+bool CBlockTreeDB::LoadBlockIndexRange(unsigned int nBegin, unsigned int nEnd, std::vector<std::pair<uint256, CDiskBlockIndex> > &vLoaded)
 {
     leveldb::Iterator *pcursor = NewIterator();
 
-    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair('b', uint256(0));
-    pcursor->Seek(ssKeySet.str());
+    CLevelDBWriter ssKeySet;
+    ssKeySet << make_pair('b', uint256(nBegin));
+    pcursor->Seek(ssKeySet.GetSlice());
 
-    // Load mapBlockIndex
+    bool fRet = true;
     while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
+        // Don't hold up a shutdown requested while loading
+        if (ShutdownRequested()) {
+            fRet = false;
+            break;
+        }
         try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            boost::this_thread::interruption_point();
+            CLevelDBReader ssKey(pcursor->key());
             char chType;
+            uint256 hashKey;
             ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                // Watch for genesis block
-                if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
-                    pindexGenesisBlock = pindexNew;
-
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+            if (chType != 'b')
+                break;
+            ssKey >> hashKey;
+            if (*hashKey.begin() >= nEnd)
+                break;
+
+            CLevelDBReader ssValue(pcursor->value());
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+            uint256 hash = diskindex.GetBlockHash();
+            if (!CheckProofOfWork(hash, diskindex.nBits)) {
+                fRet = error("LoadBlockIndex() : CheckIndex failed: %s", diskindex.ToString().c_str());
+                break;
             }
+            vLoaded.push_back(make_pair(hash, diskindex));
+
+            pcursor->Next();
+        } catch (boost::thread_interrupted) {
+            fRet = false;
+            break;
         } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            fRet = error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            break;
         }
     }
     delete pcursor;
 
+    return fRet;
+}
+
+static void ThreadLoadBlockIndexRange(CBlockTreeDB *pdb, unsigned int nBegin, unsigned int nEnd, std::vector<std::pair<uint256, CDiskBlockIndex> > *pvLoaded, char *pfRet)
+{
+    *pfRet = pdb->LoadBlockIndexRange(nBegin, nEnd, *pvLoaded);
+}
+
+bool CBlockTreeDB::LoadBlockIndexGuts()
+{
+    int64 nStart = GetTimeMillis();
+
+    // The 'b' records are keyed by block hash, so they are spread evenly over the key
+    // space. Deserializing and hashing them is split into ranges on the first byte of
+    // the hash, each handled by its own thread; only linking the entries into
+    // mapBlockIndex happens afterwards, on this thread.
+    int nThreads = std::min(std::max((int)boost::thread::hardware_concurrency(), 1), 8);
+    std::vector<std::vector<std::pair<uint256, CDiskBlockIndex> > > vRanges(nThreads);
+    std::vector<char> vfRet(nThreads, false);
+    if (nThreads == 1) {
+        vfRet[0] = LoadBlockIndexRange(0, 256, vRanges[0]);
+    } else {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ThreadLoadBlockIndexRange, this, 256 * i / nThreads, 256 * (i + 1) / nThreads, &vRanges[i], &vfRet[i]));
+        try {
+            threadGroup.join_all();
+        } catch (boost::thread_interrupted) {
+            threadGroup.interrupt_all();
+            threadGroup.join_all();
+            throw;
+        }
+    }
+
+    // Load mapBlockIndex
+    unsigned int nLoaded = 0;
+    for (int i = 0; i < nThreads; i++) {
+        if (!vfRet[i])
+            return false;
+        boost::this_thread::interruption_point();
+        for (std::vector<std::pair<uint256, CDiskBlockIndex> >::const_iterator it = vRanges[i].begin(); it != vRanges[i].end(); it++) {
+            const uint256 &hash = it->first;
+            const CDiskBlockIndex &diskindex = it->second;
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(hash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
+                pindexGenesisBlock = pindexNew;
+        }
+        nLoaded += vRanges[i].size();
+        std::vector<std::pair<uint256, CDiskBlockIndex> >().swap(vRanges[i]);
+    }
+
+    if (fDebug)
+        printf("LoadBlockIndexGuts(): %u entries loaded using %d threads in %"PRI64d"ms\n", nLoaded, nThreads, GetTimeMillis() - nStart);
+
     return true;
 }
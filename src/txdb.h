@@ -15,6 +15,7 @@ protected:
     CLevelDB db;
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(const CLevelDBProfile &profile, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256 &txid, CCoins &coins);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
@@ -23,6 +24,10 @@ public:
     bool SetBestBlock(CBlockIndex *pindex);
     bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+    void Compact();
+    // true if a chunked BatchWrite was interrupted, leaving the database between the
+    // best block and hashTarget, the block that write was for
+    bool ReadBulkWriteTarget(uint256 &hashTarget);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -30,6 +35,7 @@ class CBlockTreeDB : public CLevelDB
 {
 public:
     CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(const CLevelDBProfile &profile, bool fMemory = false, bool fWipe = false);
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
@@ -48,6 +54,11 @@ public:
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
+    // deserialize and check the block index entries whose hash starts with a byte in [nBegin, nEnd)
+    bool LoadBlockIndexRange(unsigned int nBegin, unsigned int nEnd, std::vector<std::pair<uint256, CDiskBlockIndex> > &vLoaded);
 };
 
+/** Global variable that points to the coin database underneath pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 #endif // BITCOIN_TXDB_LEVELDB_H